@@ -3,23 +3,70 @@
  https://github.com/BonzaiThePenguin/WikiSort
 
  to run:
- clang++ -o WikiSort.x WikiSort.cpp -O3
+ clang++ -o WikiSort.x WikiSort.cpp -O3 -pthread
  (or replace 'clang++' with 'g++')
  ./WikiSort.x
+
+ to benchmark other distributions, sizes, types, and comparisons against the other sorts:
+ ./WikiSort.x --distributions all --sizes 1k,100k,1m --types test,uint64 --trials 9 --csv results.csv
+ (./WikiSort.x --help lists all of the options)
 ***********************************************************/
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cerrno>
 #include <cmath>
+#include <condition_variable>
+#include <cstring>
 #include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
-// record the number of comparisons and assignments
-// note that this reduces WikiSort's performance when enabled
-#define PROFILE false
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define WIKI_MMAP true
+#else
+    #define WIKI_MMAP false
+#endif
+
+// hardware performance counters, for the benchmark
+#if defined(__linux__)
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #define WIKI_PERF_EVENTS true
+#else
+    #define WIKI_PERF_EVENTS false
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define WIKI_X86_SIMD true
+#else
+    #define WIKI_X86_SIMD false
+#endif
 
 // verify that WikiSort is actually correct
 // (this also reduces performance slightly)
@@ -29,19 +76,12 @@
 // (so we can tell whether reducing the number of comparisons was worth the added complexity)
 #define SLOW_COMPARISONS false
 
-// if true, test against std::__inplace_stable_sort() rather than std::stable_sort()
-#define TEST_INPLACE false
-
-// whether to give WikiSort a full-size cache, to see how it performs when given more memory
-#define DYNAMIC_CACHE false
-
+// if true, give each item a std::string payload, to see how it performs with items that own memory
+#define TEST_STRINGS false
 
-double Seconds() { return std::clock() * 1.0/CLOCKS_PER_SEC; }
 
-#if PROFILE
-    // global for testing how many comparisons are performed for each sorting algorithm
-    long comparisons, assignments;
-#endif
+// wall-clock time from a monotonic clock, so the benchmark isn't thrown off by the system time changing
+double Seconds() { return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
 
 // structure to represent ranges within the array
 template <typename Iterator>
@@ -143,8 +183,200 @@ RandomAccessIterator FindLastBackward(RandomAccessIterator first, RandomAccessIt
     return std::upper_bound(index, index + skip, value, compare);
 }
 
-template <typename BidirectionalIterator, typename Comparison>
-void InsertionSort(BidirectionalIterator first, BidirectionalIterator last, Comparison compare) {
+// whether the items for this iterator are stored in one contiguous array
+template <typename Iterator>
+struct IsContiguous {
+    typedef typename std::iterator_traits<Iterator>::value_type T;
+    static const bool value = std::is_pointer<Iterator>::value ||
+                              std::is_same<Iterator, typename std::vector<T>::iterator>::value;
+};
+
+// whether the comparison is the plain (a < b) for this type
+template <typename Comparison, typename T>
+struct IsLess {
+#if __cplusplus >= 201402L
+    static const bool value = std::is_same<Comparison, std::less<T> >::value ||
+                              std::is_same<Comparison, std::less<> >::value;
+#else
+    static const bool value = std::is_same<Comparison, std::less<T> >::value;
+#endif
+};
+
+// whether merges between these two kinds of iterators can copy the items without branching on each comparison
+// (only arithmetic items compared with std::less, since larger records cost more to copy than the branch saves)
+template <typename Iterator1, typename Iterator2, typename Comparison>
+struct IsFastMerge {
+    typedef typename std::iterator_traits<Iterator1>::value_type T;
+    static const bool value = IsContiguous<Iterator1>::value && IsContiguous<Iterator2>::value &&
+                              std::is_same<T, typename std::iterator_traits<Iterator2>::value_type>::value &&
+                              std::is_arithmetic<T>::value && !std::is_same<T, bool>::value && IsLess<Comparison, T>::value;
+};
+
+template <typename T>
+bool IsZeroOrNaN(T value) {
+    return !(value < 0 || value > 0);
+}
+
+namespace Wiki {
+    // the phases of the sort that the instrumentation policies below count operations for
+    enum Phase {
+        RunPhase,           // finding the runs that are already in order, and reversing the descending ones
+        NetworkPhase,       // sorting the smallest ranges with the sorting networks (or the radix sort)
+        CacheMergePhase,    // the merge sort levels whose A and B subarrays fit into the cache
+        PullPhase,          // pulling out the unique values for the internal buffers
+        BlockPhase,         // tagging the A blocks and rolling them through the B blocks
+        LocalMergePhase,    // merging each A block with the B values that follow it
+        Buffer2Phase,       // insertion sorting the second internal buffer
+        RedistributePhase,  // moving the internal buffers' values back to where they belong
+        PhaseCount
+    };
+
+    enum Operation { Comparisons, Moves, Swaps, Rotations, Searches, OperationCount };
+
+    // instrumentation policy for Sort that doesn't count anything, so every call to it compiles away
+    class NoCounters {
+    public:
+        void phase(Phase) const {}
+        void count(Operation, std::size_t = 1) const {}
+    };
+
+    // how many of each operation Sort performed in each of its phases
+    // moves and swaps are counted per item, a rotation counts as one rotation and a move for each of its items,
+    // and each binary, exponential, or linear-then-binary search counts as one search
+    class PhaseCounts {
+    public:
+        uint64_t counts[PhaseCount][OperationCount];
+        Phase current;
+
+        PhaseCounts() { clear(); }
+
+        void clear() {
+            for (std::size_t phase = 0; phase < PhaseCount; ++phase)
+                for (std::size_t operation = 0; operation < OperationCount; ++operation)
+                    counts[phase][operation] = 0;
+            current = RunPhase;
+        }
+
+        uint64_t total(Operation operation) const {
+            uint64_t sum = 0;
+            for (std::size_t phase = 0; phase < PhaseCount; ++phase) sum += counts[phase][operation];
+            return sum;
+        }
+
+        static const char * name(Phase phase) {
+            const char *names[] = { "runs", "networks", "cache merges", "pull", "blocks", "local merges", "buffer2", "redistribute" };
+            return names[phase];
+        }
+
+        static const char * name(Operation operation) {
+            const char *names[] = { "comparisons", "moves", "swaps", "rotations", "searches" };
+            return names[operation];
+        }
+    };
+
+    // instrumentation policy that adds each operation to a PhaseCounts, under whichever phase the sort is in
+    // comparisons are counted by wrapping the comparison, so the radix sort and the SIMD networks and merges,
+    // which only handle std::less and don't call it, are left out of the sort while it's being counted
+    class CountOperations {
+        PhaseCounts *counts;
+
+    public:
+        explicit CountOperations(PhaseCounts & counts):
+            counts(&counts)
+        {}
+
+        void phase(Phase phase) const {
+            counts->current = phase;
+        }
+
+        void count(Operation operation, std::size_t amount = 1) const {
+            counts->counts[counts->current][operation] += amount;
+        }
+    };
+
+    // the comparison, counting each call to it
+    template <typename Comparison, typename Counters>
+    class CountComparisons {
+    public:
+        Comparison compare;
+        Counters counters;
+        CountComparisons(Comparison compare, Counters counters) : compare(compare), counters(counters) {}
+
+        template <typename T1, typename T2>
+        bool operator()(const T1 & item1, const T2 & item2) {
+            counters.count(Comparisons);
+            return compare(item1, item2);
+        }
+    };
+
+    // the comparison the sort uses with these counters, which is the comparison itself when nothing is counted
+    template <typename Comparison>
+    Comparison CountedComparison(Comparison compare, NoCounters) {
+        return compare;
+    }
+
+    template <typename Comparison, typename Counters>
+    CountComparisons<Comparison, Counters> CountedComparison(Comparison compare, Counters counters) {
+        return CountComparisons<Comparison, Counters>(compare, counters);
+    }
+
+    // customization point for comparisons that cost far more than moving an item, like locale-aware string collation:
+    // specialize IsExpensive for the comparison with value = true, and the sort makes fewer comparisons at the cost of more moves
+    // (binary insertion sorts instead of the sorting networks, galloping merges at every level, and A blocks whose
+    // order is tracked so the minimum one is found without comparing them)
+    template <typename Comparison>
+    struct IsExpensive {
+        static const bool value = false;
+    };
+
+    // or wrap the comparison with Expensive(compare) to select that for one call to Sort
+    template <typename Comparison>
+    class ExpensiveComparison {
+    public:
+        Comparison compare;
+        ExpensiveComparison(Comparison compare) : compare(compare) {}
+
+        template <typename T1, typename T2>
+        bool operator()(const T1 & item1, const T2 & item2) {
+            return compare(item1, item2);
+        }
+    };
+
+    template <typename Comparison>
+    ExpensiveComparison<Comparison> Expensive(Comparison compare) {
+        return ExpensiveComparison<Comparison>(compare);
+    }
+
+    template <typename Comparison>
+    struct IsExpensive<ExpensiveComparison<Comparison> > {
+        static const bool value = true;
+    };
+
+    template <typename Comparison, typename Counters>
+    struct IsExpensive<CountComparisons<Comparison, Counters> > : IsExpensive<Comparison> {};
+
+    // customization point for iterators over items that are stored in contiguous segments, like std::deque's:
+    // specialize Segments for the iterator with value = true and a segment() function that returns the rest of
+    // the segment an iterator points into, from that item to the end of the segment, as a range of pointers
+    template <typename Iterator>
+    struct Segments {
+        static const bool value = false;
+    };
+
+#ifdef __GLIBCXX__
+    template <typename T>
+    struct Segments<std::_Deque_iterator<T, T &, T *> > {
+        static const bool value = true;
+
+        static Range<T *> segment(const std::_Deque_iterator<T, T &, T *> & it) {
+            return Range<T *>(it._M_cur, it._M_last);
+        }
+    };
+#endif
+}
+
+template <typename BidirectionalIterator, typename Comparison, typename Counters = Wiki::NoCounters>
+void InsertionSort(BidirectionalIterator first, BidirectionalIterator last, Comparison compare, Counters counters = Counters()) {
     typedef typename std::iterator_traits<BidirectionalIterator>::value_type T;
     if (first == last) return;
 
@@ -155,947 +387,4557 @@ void InsertionSort(BidirectionalIterator first, BidirectionalIterator last, Comp
         // Compare first so we can avoid 2 moves for
         // an element already positioned correctly.
         if (compare(*sift, *sift_1)) {
-            T tmp = *sift;
+            T tmp = std::move(*sift);
             do {
-                *sift-- = *sift_1;
+                *sift-- = std::move(*sift_1);
+                counters.count(Wiki::Moves);
             } while (sift != first && compare(tmp, *--sift_1));
-            *sift = tmp;
+            *sift = std::move(tmp);
+            counters.count(Wiki::Moves, 2);
         }
     }
 }
 
+// insertion sort that binary searches for where each item goes, which takes close to log2(n!) comparisons
+// but still O(n^2) moves, so it's only worth it for small ranges and expensive comparisons
+template <typename RandomAccessIterator, typename Comparison, typename Counters = Wiki::NoCounters>
+void BinaryInsertionSort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, Counters counters = Counters()) {
+    typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+    if (first == last) return;
+
+    // once an item was already in order, check the next one against it before searching,
+    // so nearly sorted ranges don't take more comparisons than a linear insertion sort would
+    bool in_order = false;
+    for (RandomAccessIterator cur = first + 1 ; cur != last ; ++cur) {
+        RandomAccessIterator end = cur;
+        if (in_order && !compare(*cur, *(cur - 1))) continue;
+        if (in_order) --end;
+
+        // upper_bound keeps equal items in their original order
+        RandomAccessIterator insert = std::upper_bound(first, end, *cur, compare);
+        counters.count(Wiki::Searches);
+        in_order = (insert == cur);
+        if (in_order) continue;
+
+        T tmp = std::move(*cur);
+        std::move_backward(insert, cur, cur + 1);
+        *insert = std::move(tmp);
+        counters.count(Wiki::Moves, (cur - insert) + 2);
+    }
+}
+
 namespace Wiki {
-    // merge operation using an external buffer
-    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename Comparison>
-    void MergeExternal(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
-                       RandomAccessIterator1 first2, RandomAccessIterator1 last2,
-                       RandomAccessIterator2 cache, Comparison compare) {
-        // A fits into the cache, so use that instead of the internal buffer
-        RandomAccessIterator2 A_index = cache;
-        RandomAccessIterator2 A_last = cache + std::distance(first1, last1);
-        RandomAccessIterator1 B_index = first2;
-        RandomAccessIterator1 B_last = last2;
-        RandomAccessIterator1 insert_index = first1;
+    // the cache is raw memory, so items are moved into it by constructing them there,
+    // and destroyed again after they've been moved back out into the array
+    template <typename Iterator, typename T>
+    T * MoveToCache(Iterator first, Iterator last, T *cache) {
+        return std::uninitialized_copy(std::make_move_iterator(first), std::make_move_iterator(last), cache);
+    }
 
-        if (last2 - first2 > 0 && last1 - first1 > 0) {
-            while (true) {
-                if (!compare(*B_index, *A_index)) {
-                    *insert_index = *A_index;
-                    ++A_index;
-                    ++insert_index;
-                    if (A_index == A_last) break;
-                } else {
-                    *insert_index = *B_index;
-                    ++B_index;
-                    ++insert_index;
-                    if (B_index == B_last) break;
-                }
-            }
+    template <typename T>
+    void DestroyCache(T *first, T *last) {
+        for (; first != last; ++first) first->~T();
+    }
+
+    // the same for segmented iterators, which move a whole segment at a time through pointers to its items
+    template <typename Iterator, typename T>
+    T * MoveSegmentsToCache(Iterator first, Iterator last, T *cache, std::true_type) {
+        while (first != last) {
+            Range<T *> segment = Segments<Iterator>::segment(first);
+            const std::size_t length = std::min(segment.length(), (std::size_t)(last - first));
+            cache = MoveToCache(segment.start, segment.start + length, cache);
+            first += length;
         }
+        return cache;
+    }
 
-        // copy the remainder of A into the final array
-        std::copy(A_index, A_last, insert_index);
+    template <typename Iterator, typename T>
+    T * MoveSegmentsToCache(Iterator first, Iterator last, T *cache, std::false_type) {
+        return MoveToCache(first, last, cache);
     }
 
-    // merge operation using an internal buffer
-    template<typename RandomAccessIterator, typename Comparison>
-    void MergeInternal(RandomAccessIterator first1, RandomAccessIterator last1,
-                       RandomAccessIterator first2, RandomAccessIterator last2,
-                       RandomAccessIterator buffer, Comparison compare) {
-        // whenever we find a value to add to the final array, swap it with the value that's already in that spot
-        // when this algorithm is finished, 'buffer' will contain its original contents, but in a different order
-        RandomAccessIterator A_index = buffer;
-        RandomAccessIterator B_index = first2;
-        RandomAccessIterator A_last = buffer + std::distance(first1, last1);
-        RandomAccessIterator B_last = last2;
-        RandomAccessIterator insert_index = first1;
+    // move the items in the cache back out to 'out', then destroy them
+    template <typename T, typename Iterator>
+    void MoveSegmentsFromCache(T *cache, T *cache_end, Iterator out, std::true_type) {
+        for (T *index = cache; index != cache_end; ) {
+            Range<T *> segment = Segments<Iterator>::segment(out);
+            const std::size_t length = std::min(segment.length(), (std::size_t)(cache_end - index));
+            std::move(index, index + length, segment.start);
+            index += length;
+            out += length;
+        }
+        DestroyCache(cache, cache_end);
+    }
 
-        if (last2 - first2 > 0 && last1 - first1 > 0) {
-            while (true) {
-                if (!compare(*B_index, *A_index)) {
-                    std::iter_swap(insert_index, A_index);
-                    ++A_index;
-                    ++insert_index;
-                    if (A_index == A_last) break;
-                } else {
-                    std::iter_swap(insert_index, B_index);
-                    ++B_index;
-                    ++insert_index;
-                    if (B_index == B_last) break;
+    template <typename T, typename Iterator>
+    void MoveSegmentsFromCache(T *cache, T *cache_end, Iterator out, std::false_type) {
+        std::move(cache, cache_end, out);
+        DestroyCache(cache, cache_end);
+    }
+
+    // rotate [first, middle) to after [middle, last). if the smaller side fits into the cache, move it out,
+    // shift the other side over, and move it back in on the other end.
+    // otherwise use the bridge rotation or a conjoined triple reversal (from scandum's trinity rotation), which reverses both sides
+    // and then the whole range within the same passes. like std::rotate it moves each item about once,
+    // but it only ever walks inward from both ends, rather than jumping around memory in cycles
+    template <typename RandomAccessIterator, typename Counters = NoCounters>
+    void Rotate(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last,
+                typename std::iterator_traits<RandomAccessIterator>::value_type *cache, std::size_t cache_size,
+                Counters counters = Counters()) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        std::size_t left = middle - first, right = last - middle;
+        if (left == 0 || right == 0) return;
+
+        counters.count(Rotations);
+        counters.count(Moves, left + right);
+
+        if (left <= right && left <= cache_size) {
+            T *cache_end = MoveToCache(first, middle, cache);
+            std::move(middle, last, first);
+            std::move(cache, cache_end, last - left);
+            DestroyCache(cache, cache_end);
+            return;
+        }
+        if (right < left && right <= cache_size) {
+            T *cache_end = MoveToCache(middle, last, cache);
+            std::move_backward(first, middle, last);
+            std::move(cache, cache_end, first);
+            DestroyCache(cache, cache_end);
+            return;
+        }
+        if (left == right) {
+            std::swap_ranges(first, middle, middle);
+            return;
+        }
+
+        // if the difference between the two sides fits into the cache, move that many items out of the longer side,
+        // which leaves room to move each item of the shorter side past one of the longer side in a single pass
+        std::size_t bridge = (left < right) ? right - left : left - right;
+        if (bridge <= cache_size) {
+            if (left < right) {
+                T *cache_end = MoveToCache(middle, middle + bridge, cache);
+                RandomAccessIterator ptb = middle, ptc = first + right, ptd = last;
+                while (ptb != first) {
+                    *--ptc = std::move(*--ptd);
+                    *ptd = std::move(*--ptb);
+                }
+                std::move(cache, cache_end, first);
+                DestroyCache(cache, cache_end);
+            } else {
+                T *cache_end = MoveToCache(first + right, middle, cache);
+                RandomAccessIterator pta = first, ptb = middle, ptc = first + right;
+                while (ptb != last) {
+                    *ptc++ = std::move(*pta);
+                    *pta++ = std::move(*ptb++);
                 }
+                std::move(cache, cache_end, last - bridge);
+                DestroyCache(cache, cache_end);
+            }
+            return;
+        }
+
+        // pta and ptb walk inward over the left side, ptc and ptd over the right side,
+        // and each step moves four items at once to where all three reversals would have put them
+        RandomAccessIterator pta = first, ptb = middle, ptc = middle, ptd = last;
+        for (std::size_t count = std::min(left, right) / 2; count > 0; --count) {
+            T item = std::move(*--ptb);
+            *ptb = std::move(*pta);
+            *pta++ = std::move(*ptc);
+            *ptc++ = std::move(*--ptd);
+            *ptd = std::move(item);
+        }
+
+        // then finish off whichever side is longer
+        if (left < right) {
+            for (std::size_t count = (ptd - ptc) / 2; count > 0; --count) {
+                T item = std::move(*ptc);
+                *ptc++ = std::move(*--ptd);
+                *ptd = std::move(*pta);
+                *pta++ = std::move(item);
+            }
+        } else {
+            for (std::size_t count = (ptb - pta) / 2; count > 0; --count) {
+                T item = std::move(*--ptb);
+                *ptb = std::move(*pta);
+                *pta++ = std::move(*--ptd);
+                *ptd = std::move(item);
             }
         }
 
-        // BlockSwap
-        std::swap_ranges(A_index, A_last, insert_index);
+        // and the middle section is left to be reversed by itself
+        for (std::size_t count = (ptd - pta) / 2; count > 0; --count) std::iter_swap(pta++, --ptd);
     }
 
-    // merge operation without a buffer
-    template <typename RandomAccessIterator, typename Comparison>
-    void MergeInPlace(RandomAccessIterator first1, RandomAccessIterator last1,
-                      RandomAccessIterator first2, RandomAccessIterator last2,
-                      Comparison compare) {
-        if (last1 - first1 == 0 || last2 - first2 == 0) return;
+    // merge [first1, last1) and [first2, last2) into 'out' without any branches that depend on the items,
+    // since a mispredicted branch for every item costs more than the comparison itself.
+    // out may overlap the end of the second range as long as it can't catch up with it, like in MergeExternal
+    template <typename T>
+    T * MergeBranchless(const T *first1, const T *last1, const T *first2, const T *last2, T *out) {
+        if (first1 < last1 && first2 < last2) {
+            while (true) {
+                T item1 = *first1, item2 = *first2;
+                bool second = (item2 < item1);
+                *out = second ? item2 : item1;
+                ++out;
+                first1 += !second;
+                first2 += second;
+                if (first1 == last1 || first2 == last2) break;
+            }
+        }
 
-        /*
-         this just repeatedly binary searches into B and rotates A into position.
-         the paper suggests using the 'rotation-based Hwang and Lin algorithm' here,
-         but I decided to stick with this because it had better situational performance
+        out = std::copy(first1, last1, out);
+        if (out != first2) return std::copy(first2, last2, out);
+        return out + (last2 - first2);
+    }
 
-         (Hwang and Lin is designed for merging subarrays of very different sizes,
-         but WikiSort almost always uses subarrays that are roughly the same size)
+#if WIKI_X86_SIMD
+    // bitonic merge of 32-bit integer keys within AVX2 registers, following the same rules as MergeBranchless.
+    // equal integers are indistinguishable, so this doesn't need to worry about stability.
+    // load the next eight items from whichever range has the smaller next item, merge them with the largest
+    // eight items from the previous merge, and write out the smaller half.
+    // whatever is left once either range runs out goes through MergeBranchless instead
+    template <typename T>
+    __attribute__((target("avx2")))
+    T * MergeAVX2(const T *first1, const T *last1, const T *first2, const T *last2, T *out) {
+        if (last1 - first1 < 8 || last2 - first2 < 8) return MergeBranchless(first1, last1, first2, last2, out);
 
-         normally this is incredibly suboptimal, but this function is only called
-         when none of the A or B blocks in any subarray contained 2√A unique values,
-         which places a hard limit on the number of times this will ACTUALLY need
-         to binary search and rotate.
+        const __m256i sign = std::is_unsigned<T>::value ?
+            _mm256_set1_epi32(std::numeric_limits<int32_t>::min()) : _mm256_setzero_si256();
 
-         according to my analysis the worst case is √A rotations performed on √A items
-         once the constant factors are removed, which ends up being O(n)
+        #define LOAD(from) _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(from)), sign)
+        #define LAYER(items, a, b, c, d, e, f, g, h, maxima) { \
+            __m256i other = _mm256_permutevar8x32_epi32(items, _mm256_setr_epi32(a, b, c, d, e, f, g, h)); \
+            items = _mm256_blend_epi32(_mm256_min_epi32(items, other), _mm256_max_epi32(items, other), maxima); }
 
-         again, this is NOT a general-purpose solution – it only works well in this case!
-         kind of like how the O(n^2) insertion sort is used in some places
-         */
+        __m256i lower = LOAD(first1), upper = LOAD(first2);
+        first1 += 8;
+        first2 += 8;
 
         while (true) {
-            // find the first place in B where the first item in A needs to be inserted
-            RandomAccessIterator mid = std::lower_bound(first2, last2, *first1, compare);
+            // reverse the upper half so the two form a bitonic sequence, split it, then sort each half
+            upper = _mm256_permutevar8x32_epi32(upper, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+            __m256i minimum = _mm256_min_epi32(lower, upper);
+            upper = _mm256_max_epi32(lower, upper);
+            lower = minimum;
+
+            LAYER(lower, 4, 5, 6, 7, 0, 1, 2, 3, 0xF0); LAYER(upper, 4, 5, 6, 7, 0, 1, 2, 3, 0xF0);
+            LAYER(lower, 2, 3, 0, 1, 6, 7, 4, 5, 0xCC); LAYER(upper, 2, 3, 0, 1, 6, 7, 4, 5, 0xCC);
+            LAYER(lower, 1, 0, 3, 2, 5, 4, 7, 6, 0xAA); LAYER(upper, 1, 0, 3, 2, 5, 4, 7, 6, 0xAA);
+
+            _mm256_storeu_si256((__m256i *)out, _mm256_xor_si256(lower, sign));
+            out += 8;
+
+            if (last1 - first1 < 8 || last2 - first2 < 8) break;
+            bool second = (*first2 < *first1);
+            lower = LOAD(second ? first2 : first1);
+            first1 += second ? 0 : 8;
+            first2 += second ? 8 : 0;
+        }
 
-            // rotate A into place
-            std::size_t amount = mid - last1;
-            std::rotate(first1, last1, mid);
-            if (last2 == mid) break;
+        #undef LAYER
+        #undef LOAD
 
-            // calculate the new A and B ranges
-            first2 = mid;
-            first1 += amount;
-            last1 = first2;
-            first1 = std::upper_bound(first1, last1, *first1, compare);
-            if (std::distance(first1, last1) == 0) break;
+        // merge the eight leftover items with whichever range ran out, then merge that with the other range
+        T pending[8], merged[16];
+        _mm256_storeu_si256((__m256i *)pending, _mm256_xor_si256(upper, sign));
+        if (last1 - first1 < 8) {
+            T *end = MergeBranchless((const T *)pending, (const T *)pending + 8, first1, last1, merged);
+            return MergeBranchless((const T *)merged, (const T *)end, first2, last2, out);
         }
+        T *end = MergeBranchless((const T *)pending, (const T *)pending + 8, first2, last2, merged);
+        return MergeBranchless(first1, last1, (const T *)merged, (const T *)end, out);
     }
+#endif
 
-    // calculate how to scale the index value to the range within the array
-    // the bottom-up merge sort only operates on values that are powers of two,
-    // so scale down to that power of two, then use a fraction to scale back again
-    class Iterator {
-        std::size_t size, power_of_two;
-        std::size_t decimal, numerator, denominator;
-        std::size_t decimal_step, numerator_step;
-
-    public:
+    // pick the SIMD merge for 32-bit integer keys if the CPU supports it, otherwise the branchless merge
+    // (with only four 64-bit keys per register, the SIMD merge is slower than the branchless one)
+    template <typename T, std::size_t Bytes = (std::is_integral<T>::value && !std::is_same<T, bool>::value) ? sizeof(T) : 0>
+    struct MergeKernel {
+        static T * (*select())(const T *, const T *, const T *, const T *, T *) {
+            return MergeBranchless<T>;
+        }
+    };
 
-        Iterator(std::size_t size, std::size_t min_level):
-            size(size),
-            power_of_two(Hyperfloor(size)),
-            decimal(0),
-            numerator(0),
-            denominator(power_of_two / min_level),
-            decimal_step(size / denominator),
-            numerator_step(size % denominator)
-        {}
+#if WIKI_X86_SIMD
+    template <typename T>
+    struct MergeKernel<T, 4> {
+        static T * (*select())(const T *, const T *, const T *, const T *, T *) {
+            static const bool avx2 = __builtin_cpu_supports("avx2");
+            return avx2 ? MergeAVX2<T> : MergeBranchless<T>;
+        }
+    };
+#endif
 
-        void begin() {
-            numerator = decimal = 0;
+    // move two ranges into a separate output range, like std::merge
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename Comparison>
+    RandomAccessIterator2 MergeInto(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                                    RandomAccessIterator1 first2, RandomAccessIterator1 last2,
+                                    RandomAccessIterator2 out, Comparison compare, std::false_type) {
+        if (first1 != last1 && first2 != last2) {
+            while (true) {
+                if (compare(*first2, *first1)) {
+                    *out = std::move(*first2);
+                    ++out;
+                    if (++first2 == last2) break;
+                } else {
+                    *out = std::move(*first1);
+                    ++out;
+                    if (++first1 == last1) break;
+                }
+            }
         }
 
-        template <typename Iterator>
-        Range<Iterator> nextRange(Iterator it) {
-            std::size_t start = decimal;
+        out = std::move(first1, last1, out);
+        return std::move(first2, last2, out);
+    }
 
-            decimal += decimal_step;
-            numerator += numerator_step;
-            if (numerator >= denominator) {
-                numerator -= denominator;
-                ++decimal;
-            }
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename Comparison>
+    RandomAccessIterator2 MergeInto(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                                    RandomAccessIterator1 first2, RandomAccessIterator1 last2,
+                                    RandomAccessIterator2 out, Comparison, std::true_type) {
+        typedef typename std::iterator_traits<RandomAccessIterator1>::value_type T;
+        const T *A = &*first1, *B = &*first2;
+        T *insert = &*out;
+        return out + (MergeKernel<T>::select()(A, A + (last1 - first1), B, B + (last2 - first2), insert) - insert);
+    }
 
-            return Range<Iterator>(it + start, it + decimal);
-        }
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename Comparison>
+    RandomAccessIterator2 MergeInto(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                                    RandomAccessIterator1 first2, RandomAccessIterator1 last2,
+                                    RandomAccessIterator2 out, Comparison compare) {
+        return MergeInto(first1, last1, first2, last2, out, compare,
+                         std::integral_constant<bool, IsFastMerge<RandomAccessIterator1, RandomAccessIterator2, Comparison>::value>());
+    }
 
-        bool finished() const {
-            return decimal >= size;
+    // the same merge, but into the raw memory of the cache
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    T * MergeIntoCache(RandomAccessIterator first1, RandomAccessIterator last1,
+                       RandomAccessIterator first2, RandomAccessIterator last2,
+                       T *cache, Comparison compare, std::false_type) {
+        if (first1 != last1 && first2 != last2) {
+            while (true) {
+                if (compare(*first2, *first1)) {
+                    ::new ((void *)cache) T(std::move(*first2));
+                    ++cache;
+                    if (++first2 == last2) break;
+                } else {
+                    ::new ((void *)cache) T(std::move(*first1));
+                    ++cache;
+                    if (++first1 == last1) break;
+                }
+            }
         }
 
-        bool nextLevel() {
-            decimal_step += decimal_step;
-            numerator_step += numerator_step;
-            if (numerator_step >= denominator) {
-                numerator_step -= denominator;
-                ++decimal_step;
-            }
+        cache = MoveToCache(first1, last1, cache);
+        return MoveToCache(first2, last2, cache);
+    }
 
-            return decimal_step < size;
+    // trivially copyable items don't need to be constructed in the cache, so they can use the faster merges
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    T * MergeIntoCache(RandomAccessIterator first1, RandomAccessIterator last1,
+                       RandomAccessIterator first2, RandomAccessIterator last2,
+                       T *cache, Comparison compare, std::true_type) {
+        return MergeInto(first1, last1, first2, last2, cache, compare, std::true_type());
+    }
+
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    T * MergeIntoCache(RandomAccessIterator first1, RandomAccessIterator last1,
+                       RandomAccessIterator first2, RandomAccessIterator last2,
+                       T *cache, Comparison compare) {
+        return MergeIntoCache(first1, last1, first2, last2, cache, compare,
+                              std::integral_constant<bool, IsFastMerge<RandomAccessIterator, T *, Comparison>::value>());
+    }
+
+    // exponential search from 'first' for the first item greater than 'value', like std::upper_bound,
+    // which only takes O(log k) comparisons when that item is k items away
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    RandomAccessIterator GallopUpperBound(RandomAccessIterator first, RandomAccessIterator last,
+                                          const T & value, Comparison compare) {
+        std::size_t size = last - first, bound = 1;
+        while (bound < size && !compare(value, first[bound])) bound *= 2;
+        return std::upper_bound(first + bound/2, first + std::min(bound, size), value, compare);
+    }
+
+    // exponential search for the first item that isn't less than 'value', like std::lower_bound
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    RandomAccessIterator GallopLowerBound(RandomAccessIterator first, RandomAccessIterator last,
+                                          const T & value, Comparison compare) {
+        std::size_t size = last - first, bound = 1;
+        while (bound < size && compare(first[bound], value)) bound *= 2;
+        return std::lower_bound(first + bound/2, first + std::min(bound, size), value, compare);
+    }
+
+    // how the merges put each item into place: MergeExternal moves them out of the cache,
+    // while MergeInternal swaps them with the contents of the internal buffer
+    class MoveItems {
+    public:
+        static const Operation operation = Moves;
+
+        template <typename Iterator1, typename Iterator2>
+        static void item(Iterator1 from, Iterator2 to) {
+            *to = std::move(*from);
         }
 
-        std::size_t length() const {
-            return decimal_step;
+        template <typename Iterator1, typename Iterator2>
+        static Iterator2 range(Iterator1 first, Iterator1 last, Iterator2 out) {
+            return std::move(first, last, out);
         }
     };
 
-#if DYNAMIC_CACHE
-    // use a class so the memory for the cache is freed when the object goes out of scope,
-    // regardless of whether exceptions were thrown (only needed in the C++ version)
-    template <typename T>
-    class Cache {
+    class SwapItems {
     public:
-        T *cache;
-        std::size_t cache_size;
+        static const Operation operation = Swaps;
 
-        ~Cache() {
-            if (cache) delete[] cache;
+        template <typename Iterator1, typename Iterator2>
+        static void item(Iterator1 from, Iterator2 to) {
+            std::iter_swap(from, to);
+        }
+
+        // one item at a time from the start, since 'out' may overlap the start of the range
+        template <typename Iterator1, typename Iterator2>
+        static Iterator2 range(Iterator1 first, Iterator1 last, Iterator2 out) {
+            for (; first != last; ++first, ++out) std::iter_swap(first, out);
+            return out;
+        }
+    };
+
+    // merge A into the space before B one item at a time, until one side wins 'min_gallop' comparisons in a row.
+    // then gallop: search for where that side's streak ends, put the whole streak into place at once,
+    // and do the same for the other side, for as long as the streaks stay long.
+    // like TimSort, min_gallop drops each time galloping pays off and rises when it stops paying off,
+    // so merges that alternate between A and B go back to the plain loop
+    template <typename Transfer, typename IteratorA, typename IteratorB, typename Comparison, typename Counters>
+    void MergeGalloping(IteratorA A_index, IteratorA A_last, IteratorB B_index, IteratorB B_last,
+                        IteratorB insert_index, Comparison compare, Counters counters) {
+        const std::size_t gallop_length = 7;
+        std::size_t min_gallop = gallop_length;
+
+        if (A_index == A_last || B_index == B_last) {
+            counters.count(Transfer::operation, A_last - A_index);
+            Transfer::range(A_index, A_last, insert_index);
+            return;
+        }
+
+        while (true) {
+            std::size_t A_count = 0, B_count = 0;
+            do {
+                counters.count(Transfer::operation);
+                if (!compare(*B_index, *A_index)) {
+                    Transfer::item(A_index, insert_index);
+                    ++A_index;
+                    ++insert_index;
+                    if (A_index == A_last) return;
+
+                    ++A_count;
+                    B_count = 0;
+                } else {
+                    Transfer::item(B_index, insert_index);
+                    ++B_index;
+                    ++insert_index;
+                    if (B_index == B_last) {
+                        Transfer::range(A_index, A_last, insert_index);
+                        return;
+                    }
+
+                    ++B_count;
+                    A_count = 0;
+                }
+            } while (A_count < min_gallop && B_count < min_gallop);
+
+            do {
+                // every A item up to the next B item, and then that B item
+                IteratorA A_end = GallopUpperBound(A_index, A_last, *B_index, compare);
+                A_count = A_end - A_index;
+                counters.count(Searches);
+                counters.count(Transfer::operation, A_count);
+                insert_index = Transfer::range(A_index, A_end, insert_index);
+                A_index = A_end;
+                if (A_index == A_last) return;
+
+                counters.count(Transfer::operation);
+                Transfer::item(B_index, insert_index);
+                ++B_index;
+                ++insert_index;
+                if (B_index == B_last) {
+                    counters.count(Transfer::operation, A_last - A_index);
+                    Transfer::range(A_index, A_last, insert_index);
+                    return;
+                }
+
+                // every B item before the next A item, and then that A item
+                IteratorB B_end = GallopLowerBound(B_index, B_last, *A_index, compare);
+                B_count = B_end - B_index;
+                counters.count(Searches);
+                counters.count(Transfer::operation, B_count);
+                insert_index = Transfer::range(B_index, B_end, insert_index);
+                B_index = B_end;
+                if (B_index == B_last) {
+                    counters.count(Transfer::operation, A_last - A_index);
+                    Transfer::range(A_index, A_last, insert_index);
+                    return;
+                }
+
+                counters.count(Transfer::operation);
+                Transfer::item(A_index, insert_index);
+                ++A_index;
+                ++insert_index;
+                if (A_index == A_last) return;
+
+                if (min_gallop > 1) --min_gallop;
+            } while (A_count >= gallop_length || B_count >= gallop_length);
+
+            min_gallop += 2;
+        }
+    }
+
+    // merge operation using an external buffer
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename Comparison, typename Counters>
+    void MergeExternal(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                       RandomAccessIterator1 first2, RandomAccessIterator1 last2,
+                       RandomAccessIterator2 cache, Comparison compare, Counters counters, std::false_type) {
+        // A fits into the cache, so use that instead of the internal buffer
+        MergeGalloping<MoveItems>(cache, cache + std::distance(first1, last1), first2, last2, first1, compare, counters);
+    }
+
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename Comparison, typename Counters>
+    void MergeExternal(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                       RandomAccessIterator1 first2, RandomAccessIterator1 last2,
+                       RandomAccessIterator2 cache, Comparison, Counters counters, std::true_type) {
+        typedef typename std::iterator_traits<RandomAccessIterator1>::value_type T;
+        counters.count(Moves, (last1 - first1) + (last2 - first2));
+        if (first2 == last2) {
+            std::copy(cache, cache + (last1 - first1), first1);
+            return;
+        }
+
+        const T *A = &*cache, *B = &*first2;
+        MergeKernel<T>::select()(A, A + (last1 - first1), B, B + (last2 - first2), &*first1);
+    }
+
+    // A was moved into the cache, and is destroyed there once it has been merged back into the array
+    template <typename RandomAccessIterator, typename T, typename Comparison, typename Counters = NoCounters>
+    void MergeExternal(RandomAccessIterator first1, RandomAccessIterator last1,
+                       RandomAccessIterator first2, RandomAccessIterator last2,
+                       T *cache, Comparison compare, Counters counters = Counters()) {
+        MergeExternal(first1, last1, first2, last2, cache, compare, counters,
+                      std::integral_constant<bool, IsFastMerge<T *, RandomAccessIterator, Comparison>::value>());
+        DestroyCache(cache, cache + (last1 - first1));
+    }
+
+    // compare(item2, item1), for merging from the back to the front through reverse iterators
+    template <typename Comparison>
+    class ReverseCompare {
+    public:
+        Comparison compare;
+        ReverseCompare(Comparison compare) : compare(compare) {}
+
+        template <typename T1, typename T2>
+        bool operator()(const T1 & item1, const T2 & item2) {
+            return compare(item2, item1);
+        }
+    };
+
+    // the same merge when B was moved into the cache instead, which merges from the end of the two ranges
+    // (with everything reversed, equal items from the cache still go after the ones from A)
+    template <typename RandomAccessIterator, typename T, typename Comparison, typename Counters = NoCounters>
+    void MergeExternalBackward(RandomAccessIterator first1, RandomAccessIterator last1,
+                               RandomAccessIterator first2, RandomAccessIterator last2,
+                               T *cache, Comparison compare, Counters counters = Counters()) {
+        T *cache_end = cache + (last2 - first2);
+        MergeGalloping<MoveItems>(std::reverse_iterator<T *>(cache_end), std::reverse_iterator<T *>(cache),
+                                  std::reverse_iterator<RandomAccessIterator>(last1), std::reverse_iterator<RandomAccessIterator>(first1),
+                                  std::reverse_iterator<RandomAccessIterator>(last2), ReverseCompare<Comparison>(compare), counters);
+        DestroyCache(cache, cache_end);
+    }
+
+    // merge operation using an internal buffer
+    template<typename RandomAccessIterator, typename Comparison, typename Counters = NoCounters>
+    void MergeInternal(RandomAccessIterator first1, RandomAccessIterator last1,
+                       RandomAccessIterator first2, RandomAccessIterator last2,
+                       RandomAccessIterator buffer, Comparison compare, Counters counters = Counters()) {
+        // whenever we find a value to add to the final array, swap it with the value that's already in that spot
+        // when this algorithm is finished, 'buffer' will contain its original contents, but in a different order
+        MergeGalloping<SwapItems>(buffer, buffer + std::distance(first1, last1), first2, last2, first1, compare, counters);
+    }
+
+    // rotation-based Hwang and Lin merge, for when A is much smaller than B:
+    // to find where A's first item goes, skip over B in blocks of 2^⌊log(|B|/|A|)⌋ items, binary search within the last block,
+    // and rotate A into place there. then A's items up to B's next item are also where they belong
+    // this takes O(|A| log(|B|/|A|)) comparisons, and since A is small, rotating it over and over stays cheap
+    template <typename RandomAccessIterator, typename Comparison, typename Counters>
+    void MergeHwangLin(RandomAccessIterator first1, RandomAccessIterator last1,
+                       RandomAccessIterator first2, RandomAccessIterator last2,
+                       typename std::iterator_traits<RandomAccessIterator>::value_type *cache, std::size_t cache_size,
+                       Comparison compare, Counters counters) {
+        while (first1 != last1 && first2 != last2) {
+            std::size_t block = Hyperfloor(std::max((std::size_t)((last2 - first2) / (last1 - first1)), (std::size_t)1));
+            RandomAccessIterator mid = first2;
+            while ((std::size_t)(last2 - mid) > block && compare(*(mid + block - 1), *first1)) mid += block;
+            mid = std::lower_bound(mid, mid + std::min(block, (std::size_t)(last2 - mid)), *first1, compare);
+            counters.count(Searches);
+
+            Rotate(first1, last1, mid, cache, cache_size, counters);
+            if (mid == last2) break;
+
+            first1 = std::upper_bound(first1 + (mid - last1), mid, *mid, compare);
+            counters.count(Searches);
+            last1 = first2 = mid;
+        }
+    }
+
+    // the same merge for when B is much smaller than A, working backward from the end of B
+    template <typename RandomAccessIterator, typename Comparison, typename Counters>
+    void MergeHwangLinBackward(RandomAccessIterator first1, RandomAccessIterator last1,
+                               RandomAccessIterator first2, RandomAccessIterator last2,
+                               typename std::iterator_traits<RandomAccessIterator>::value_type *cache, std::size_t cache_size,
+                               Comparison compare, Counters counters) {
+        while (first1 != last1 && first2 != last2) {
+            std::size_t block = Hyperfloor(std::max((std::size_t)((last1 - first1) / (last2 - first2)), (std::size_t)1));
+            RandomAccessIterator mid = last1;
+            while ((std::size_t)(mid - first1) > block && compare(*(last2 - 1), *(mid - block))) mid -= block;
+            mid = std::upper_bound(mid - std::min(block, (std::size_t)(mid - first1)), mid, *(last2 - 1), compare);
+            counters.count(Searches);
+
+            Rotate(mid, first2, last2, cache, cache_size, counters);
+            if (mid == first1) break;
+
+            last2 = std::lower_bound(mid, mid + (last2 - first2), *(mid - 1), compare);
+            counters.count(Searches);
+            last1 = first2 = mid;
+        }
+    }
+
+    // merge operation without a buffer
+    template <typename RandomAccessIterator, typename Comparison, typename Counters = NoCounters>
+    void MergeInPlace(RandomAccessIterator first1, RandomAccessIterator last1,
+                      RandomAccessIterator first2, RandomAccessIterator last2,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache, std::size_t cache_size,
+                      Comparison compare, Counters counters = Counters()) {
+        if (last1 - first1 == 0 || last2 - first2 == 0) return;
+
+        // when one side is much larger than the other, use the rotation-based Hwang and Lin merge instead,
+        // rotating whichever side is smaller
+        const std::size_t hwang_lin_ratio = 4;
+        if ((std::size_t)(last2 - first2) / (last1 - first1) >= hwang_lin_ratio) {
+            MergeHwangLin(first1, last1, first2, last2, cache, cache_size, compare, counters);
+            return;
+        }
+        if ((std::size_t)(last1 - first1) / (last2 - first2) >= hwang_lin_ratio) {
+            MergeHwangLinBackward(first1, last1, first2, last2, cache, cache_size, compare, counters);
+            return;
+        }
+
+        /*
+         this just repeatedly binary searches into B and rotates A into position.
+         the paper suggests using the 'rotation-based Hwang and Lin algorithm' here,
+         but I decided to stick with this because it had better situational performance
+         (it's only used above for merges where one side is many times larger than the other)
+
+         (Hwang and Lin is designed for merging subarrays of very different sizes,
+         but WikiSort almost always uses subarrays that are roughly the same size)
+
+         normally this is incredibly suboptimal, but this function is only called
+         when none of the A or B blocks in any subarray contained 2√A unique values,
+         which places a hard limit on the number of times this will ACTUALLY need
+         to binary search and rotate.
+
+         according to my analysis the worst case is √A rotations performed on √A items
+         once the constant factors are removed, which ends up being O(n)
+
+         again, this is NOT a general-purpose solution – it only works well in this case!
+         kind of like how the O(n^2) insertion sort is used in some places
+         */
+
+        while (true) {
+            // find the first place in B where the first item in A needs to be inserted
+            RandomAccessIterator mid = std::lower_bound(first2, last2, *first1, compare);
+            counters.count(Searches);
+
+            // rotate A into place
+            std::size_t amount = mid - last1;
+            Rotate(first1, last1, mid, cache, cache_size, counters);
+            if (last2 == mid) break;
+
+            // calculate the new A and B ranges
+            first2 = mid;
+            first1 += amount;
+            last1 = first2;
+            first1 = std::upper_bound(first1, last1, *first1, compare);
+            counters.count(Searches);
+            if (std::distance(first1, last1) == 0) break;
+        }
+    }
+
+    // calculate how to scale the index value to the range within the array
+    // the bottom-up merge sort only operates on values that are powers of two,
+    // so scale down to that power of two, then use a fraction to scale back again
+    class Iterator {
+        std::size_t size, power_of_two;
+        std::size_t decimal, numerator, denominator;
+        std::size_t decimal_step, numerator_step;
+        std::size_t start_decimal, start_numerator, end_decimal;
+        std::size_t ranges;
+
+    public:
+
+        Iterator(std::size_t size, std::size_t min_level):
+            size(size),
+            power_of_two(Hyperfloor(size)),
+            decimal(0),
+            numerator(0),
+            denominator(power_of_two / min_level),
+            decimal_step(size / denominator),
+            numerator_step(size % denominator),
+            start_decimal(0),
+            start_numerator(0),
+            end_decimal(size),
+            ranges(denominator)
+        {}
+
+        void begin() {
+            decimal = start_decimal;
+            numerator = start_numerator;
+        }
+
+        // only visit 'count' ranges starting from the 'index'th range within this level,
+        // so separate threads can each work on their own section of the array
+        void select(std::size_t index, std::size_t count) {
+            start_decimal = index * decimal_step + (index * numerator_step) / denominator;
+            start_numerator = (index * numerator_step) % denominator;
+            end_decimal = (index + count) * decimal_step + ((index + count) * numerator_step) / denominator;
+            ranges = count;
+            begin();
+        }
+
+        template <typename Iterator>
+        Range<Iterator> nextRange(Iterator it) {
+            std::size_t start = decimal;
+
+            decimal += decimal_step;
+            numerator += numerator_step;
+            if (numerator >= denominator) {
+                numerator -= denominator;
+                ++decimal;
+            }
+
+            return Range<Iterator>(it + start, it + decimal);
+        }
+
+        bool finished() const {
+            return decimal >= end_decimal;
+        }
+
+        bool nextLevel() {
+            decimal_step += decimal_step;
+            numerator_step += numerator_step;
+            if (numerator_step >= denominator) {
+                numerator_step -= denominator;
+                ++decimal_step;
+            }
+            ranges /= 2;
+
+            return decimal_step < size;
+        }
+
+        std::size_t length() const {
+            return decimal_step;
+        }
+
+        // the length of the longest ranges at this level, which are one longer than length() when the ranges don't divide evenly
+        std::size_t max_length() const {
+            return decimal_step + (numerator_step > 0 ? 1 : 0);
+        }
+
+        // the number of ranges that will be visited at this level
+        std::size_t count() const {
+            return ranges;
+        }
+    };
+
+    // visits the A and B ranges of a single merge, using the same interface as Wiki::Iterator,
+    // so MergeLevel can also be used to merge any two adjacent sorted ranges
+    class PairIterator {
+        std::size_t middle, last, index;
+
+    public:
+
+        PairIterator(std::size_t middle, std::size_t last):
+            middle(middle),
+            last(last),
+            index(0)
+        {}
+
+        void begin() {
+            index = 0;
+        }
+
+        template <typename Iterator>
+        Range<Iterator> nextRange(Iterator it) {
+            if (index++ == 0) return Range<Iterator>(it, it + middle);
+            return Range<Iterator>(it + middle, it + last);
+        }
+
+        bool finished() const {
+            return index >= 2;
+        }
+
+        // the A blocks are taken from the first range, so this only needs to be its length
+        std::size_t length() const {
+            return middle;
+        }
+
+        std::size_t max_length() const {
+            return middle;
+        }
+
+        std::size_t count() const {
+            return 2;
+        }
+    };
+
+    // the size in bytes of the CPU's level 1 data cache or its level 2 cache, or 0 if it can't be found
+    inline std::size_t DetectCacheBytes(int level) {
+        #if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+            long bytes = sysconf((level == 1) ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+            if (bytes > 0) return bytes;
+        #endif
+
+        #if defined(__linux__)
+            // otherwise each of cpu0's caches has a directory listing its level, type, and size (like "48K")
+            for (int index = 0; index < 16; index++) {
+                char path[64];
+                std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/", index);
+
+                int cache_level = 0;
+                std::string type, size;
+                std::ifstream(std::string(path) + "level") >> cache_level;
+                std::ifstream(std::string(path) + "type") >> type;
+                std::ifstream(std::string(path) + "size") >> size;
+                if (cache_level != level || type == "Instruction" || size.empty()) continue;
+
+                std::size_t bytes = std::strtoul(size.c_str(), NULL, 10);
+                if (size[size.length() - 1] == 'K') bytes *= 1024;
+                else if (size[size.length() - 1] == 'M') bytes *= 1024 * 1024;
+                return bytes;
+            }
+        #endif
+
+        return 0;
+    }
+
+    // the sizes of the L1 data cache, which bounds Sort's cache on the stack, and of the L2 cache, half of which
+    // each thread of the parallel sort uses for its cache on the heap (so the items being merged with it stay resident too)
+    // the sizes are detected once, and the common 32 KB L1 and 256 KB L2 caches are assumed if that fails
+    inline std::size_t L1CacheBytes() {
+        static const std::size_t bytes = DetectCacheBytes(1);
+        return (bytes > 0) ? bytes : 32 * 1024;
+    }
+
+    inline std::size_t L2CacheBytes() {
+        static const std::size_t bytes = DetectCacheBytes(2);
+        return (bytes > 0) ? bytes : 256 * 1024;
+    }
+
+    // how many items fit into that many bytes of cache (always at least one)
+    template <typename T>
+    std::size_t CacheItems(std::size_t bytes) {
+        return std::max(bytes/sizeof(T), (std::size_t)1);
+    }
+
+    // Sort keeps its cache on the stack, so limit it to 32 KB regardless of how large each item is
+    template <typename T>
+    class StackCache {
+    public:
+        static const std::size_t max_bytes = 32 * 1024;
+        static const std::size_t size = (sizeof(T) < max_bytes) ? max_bytes/sizeof(T) : 1;
+    };
+
+    // raw memory for 'size' items, or null if it couldn't be allocated
+    // nothing is constructed in it, since Sort moves items into the cache and destroys them again itself
+    template <typename T>
+    T * AllocateCache(std::size_t size) {
+        return static_cast<T *>(::operator new(size * sizeof(T), std::nothrow));
+    }
+
+    inline void FreeCache(void *cache) {
+        ::operator delete(cache);
+    }
+
+    // allocate a cache that can be passed to Sort as its scratch memory
+    // use a class so the memory for the cache is freed when the object goes out of scope,
+    // regardless of whether exceptions were thrown (only needed in the C++ version)
+    template <typename T>
+    class Cache {
+    public:
+        T *cache;
+        std::size_t cache_size;
+
+        ~Cache() {
+            FreeCache(cache);
         }
 
         Cache(std::size_t size) {
             // good choices for the cache size are:
             // (size + 1)/2 – turns into a full-speed standard merge sort since everything fits into the cache
             cache_size = (size + 1)/2;
-            cache = new (std::nothrow) T[cache_size];
+            cache = AllocateCache<T>(cache_size);
+            if (cache) return;
+
+            // sqrt((size + 1)/2) + 1 – this will be the size of the A blocks at the largest level of merges,
+            // so a buffer of this size would allow it to skip using internal or in-place merges for anything
+            cache_size = std::sqrt(cache_size) + 1;
+            cache = AllocateCache<T>(cache_size);
             if (cache) return;
 
-            // sqrt((size + 1)/2) + 1 – this will be the size of the A blocks at the largest level of merges,
-            // so a buffer of this size would allow it to skip using internal or in-place merges for anything
-            cache_size = std::sqrt(cache_size) + 1;
-            cache = new (std::nothrow) T[cache_size];
-            if (cache) return;
+            // the L1 data cache – a good balance between fixed-size memory use and run time
+            if (cache_size > CacheItems<T>(L1CacheBytes())) {
+                cache_size = CacheItems<T>(L1CacheBytes());
+                cache = AllocateCache<T>(cache_size);
+                if (cache) return;
+            }
+
+            // 0 – if the system simply cannot allocate any extra memory whatsoever, no memory works just fine
+            cache_size = 0;
+        }
+
+    private:
+        Cache(const Cache &);
+        Cache & operator=(const Cache &);
+    };
+
+    // sort a group of 4-8 items using an unstable sorting network,
+    // but keep track of the original item orders to force it to be stable
+    // http://pages.ripco.net/~jgamble/nw.html
+    template <typename RandomAccessIterator, typename Comparison, typename Counters = NoCounters>
+    void SortNetwork(Range<RandomAccessIterator> range, Comparison compare, Counters counters = Counters()) {
+        int order[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+        #define SWAP(x, y) \
+            if (compare(range.start[y], range.start[x]) || \
+                (order[x] > order[y] && !compare(range.start[x], range.start[y]))) { \
+                std::iter_swap(range.start + x, range.start + y); \
+                std::iter_swap(order + x, order + y); \
+                counters.count(Swaps); }
+
+        if (range.length() == 8) {
+            SWAP(0, 1); SWAP(2, 3); SWAP(4, 5); SWAP(6, 7);
+            SWAP(0, 2); SWAP(1, 3); SWAP(4, 6); SWAP(5, 7);
+            SWAP(1, 2); SWAP(5, 6); SWAP(0, 4); SWAP(3, 7);
+            SWAP(1, 5); SWAP(2, 6);
+            SWAP(1, 4); SWAP(3, 6);
+            SWAP(2, 4); SWAP(3, 5);
+            SWAP(3, 4);
+
+        } else if (range.length() == 7) {
+            SWAP(1, 2); SWAP(3, 4); SWAP(5, 6);
+            SWAP(0, 2); SWAP(3, 5); SWAP(4, 6);
+            SWAP(0, 1); SWAP(4, 5); SWAP(2, 6);
+            SWAP(0, 4); SWAP(1, 5);
+            SWAP(0, 3); SWAP(2, 5);
+            SWAP(1, 3); SWAP(2, 4);
+            SWAP(2, 3);
+
+        } else if (range.length() == 6) {
+            SWAP(1, 2); SWAP(4, 5);
+            SWAP(0, 2); SWAP(3, 5);
+            SWAP(0, 1); SWAP(3, 4); SWAP(2, 5);
+            SWAP(0, 3); SWAP(1, 4);
+            SWAP(2, 4); SWAP(1, 3);
+            SWAP(2, 3);
+
+        } else if (range.length() == 5) {
+            SWAP(0, 1); SWAP(3, 4);
+            SWAP(2, 4);
+            SWAP(2, 3); SWAP(1, 4);
+            SWAP(0, 3);
+            SWAP(0, 2); SWAP(1, 3);
+            SWAP(1, 2);
+
+        } else if (range.length() == 4) {
+            SWAP(0, 1); SWAP(2, 3);
+            SWAP(0, 2); SWAP(1, 3);
+            SWAP(1, 2);
+        }
+
+        #undef SWAP
+    }
+
+#if WIKI_X86_SIMD
+    // SIMD versions of the sorting networks, for arithmetic keys compared with std::less.
+    // equal keys are indistinguishable, so these don't need the order[] bookkeeping to stay stable.
+    // each key is mapped to a signed integer with the same ordering (flipping the sign bit of unsigned keys,
+    // or the other bits of negative floating-point keys) and mapped back afterward, which is its own inverse.
+    // -0.0 and +0.0 compare equal but would not map to the same integer, so groups containing zeros or NaNs
+    // are left to the scalar networks
+
+    // 4-8 32-bit keys in one AVX2 register, using the same 19-comparator network as the scalar code
+    template <typename T>
+    __attribute__((target("avx2")))
+    void SortNetworksAVX2_32(T *first, Wiki::Iterator iterator) {
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i sign = _mm256_set1_epi32(std::numeric_limits<int32_t>::min());
+        const __m256i padding = _mm256_set1_epi32(std::numeric_limits<int32_t>::max());
+
+        iterator.begin();
+        while (!iterator.finished()) {
+            Range<T*> range = iterator.nextRange(first);
+            const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(range.length()), lanes);
+            __m256i items = _mm256_maskload_epi32((const int *)range.start, mask);
+
+            if (std::is_floating_point<T>::value) {
+                __m256 zero = _mm256_cmp_ps(_mm256_castsi256_ps(items), _mm256_setzero_ps(), _CMP_EQ_UQ);
+                if (_mm256_movemask_ps(_mm256_and_ps(zero, _mm256_castsi256_ps(mask)))) {
+                    SortNetwork(range, std::less<T>());
+                    continue;
+                }
+                items = _mm256_xor_si256(items, _mm256_srli_epi32(_mm256_srai_epi32(items, 31), 1));
+            } else if (std::is_unsigned<T>::value) {
+                items = _mm256_xor_si256(items, sign);
+            }
+            items = _mm256_blendv_epi8(padding, items, mask);
+
+            #define LAYER(a, b, c, d, e, f, g, h, maxima) { \
+                __m256i other = _mm256_permutevar8x32_epi32(items, _mm256_setr_epi32(a, b, c, d, e, f, g, h)); \
+                items = _mm256_blend_epi32(_mm256_min_epi32(items, other), _mm256_max_epi32(items, other), maxima); }
+
+            LAYER(1, 0, 3, 2, 5, 4, 7, 6, 0xAA);
+            LAYER(2, 3, 0, 1, 6, 7, 4, 5, 0xCC);
+            LAYER(4, 2, 1, 7, 0, 6, 5, 3, 0xD4);
+            LAYER(0, 5, 6, 3, 4, 1, 2, 7, 0x60);
+            LAYER(0, 4, 2, 6, 1, 5, 3, 7, 0x50);
+            LAYER(0, 1, 4, 5, 2, 3, 6, 7, 0x30);
+            LAYER(0, 1, 2, 4, 3, 5, 6, 7, 0x10);
+
+            #undef LAYER
+
+            if (std::is_floating_point<T>::value) {
+                items = _mm256_xor_si256(items, _mm256_srli_epi32(_mm256_srai_epi32(items, 31), 1));
+            } else if (std::is_unsigned<T>::value) {
+                items = _mm256_xor_si256(items, sign);
+            }
+            _mm256_maskstore_epi32((int *)range.start, mask, items);
+        }
+    }
+
+    // 4-8 64-bit keys in two AVX2 registers: sort each register, then a bitonic merge of the two
+    template <typename T>
+    __attribute__((target("avx2")))
+    void SortNetworksAVX2_64(T *first, Wiki::Iterator iterator) {
+        const __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+        const __m256i sign = _mm256_set1_epi64x(std::numeric_limits<int64_t>::min());
+        const __m256i padding = _mm256_set1_epi64x(std::numeric_limits<int64_t>::max());
+        const __m256i zero = _mm256_setzero_si256();
+
+        iterator.begin();
+        while (!iterator.finished()) {
+            Range<T*> range = iterator.nextRange(first);
+            const __m256i length = _mm256_set1_epi64x(range.length());
+            const __m256i mask1 = _mm256_cmpgt_epi64(length, lanes);
+            const __m256i mask2 = _mm256_cmpgt_epi64(length, _mm256_add_epi64(lanes, _mm256_set1_epi64x(4)));
+            __m256i items1 = _mm256_maskload_epi64((const long long *)range.start, mask1);
+            __m256i items2 = _mm256_maskload_epi64((const long long *)range.start + 4, mask2);
+
+            if (std::is_floating_point<T>::value) {
+                __m256d zero1 = _mm256_cmp_pd(_mm256_castsi256_pd(items1), _mm256_setzero_pd(), _CMP_EQ_UQ);
+                __m256d zero2 = _mm256_cmp_pd(_mm256_castsi256_pd(items2), _mm256_setzero_pd(), _CMP_EQ_UQ);
+                if (_mm256_movemask_pd(_mm256_and_pd(zero1, _mm256_castsi256_pd(mask1))) |
+                    _mm256_movemask_pd(_mm256_and_pd(zero2, _mm256_castsi256_pd(mask2)))) {
+                    SortNetwork(range, std::less<T>());
+                    continue;
+                }
+            }
+
+            #define KEY(items) \
+                if (std::is_floating_point<T>::value) { \
+                    items = _mm256_xor_si256(items, _mm256_srli_epi64(_mm256_cmpgt_epi64(zero, items), 1)); \
+                } else if (std::is_unsigned<T>::value) { \
+                    items = _mm256_xor_si256(items, sign); }
+
+            #define LAYER(items, order, maxima) { \
+                __m256i other = _mm256_permute4x64_epi64(items, order); \
+                __m256i greater = _mm256_cmpgt_epi64(items, other); \
+                items = _mm256_blend_epi32(_mm256_blendv_epi8(items, other, greater), \
+                                           _mm256_blendv_epi8(other, items, greater), maxima); }
+
+            KEY(items1); KEY(items2);
+            items1 = _mm256_blendv_epi8(padding, items1, mask1);
+            items2 = _mm256_blendv_epi8(padding, items2, mask2);
+
+            LAYER(items1, 0xB1, 0xCC); LAYER(items2, 0xB1, 0xCC);
+            LAYER(items1, 0x4E, 0xF0); LAYER(items2, 0x4E, 0xF0);
+            LAYER(items1, 0xD8, 0x30); LAYER(items2, 0xD8, 0x30);
+
+            // reverse the second register so the two of them form a bitonic sequence, then split it in half
+            items2 = _mm256_permute4x64_epi64(items2, 0x1B);
+            __m256i greater = _mm256_cmpgt_epi64(items1, items2);
+            __m256i lower = _mm256_blendv_epi8(items1, items2, greater);
+            items2 = _mm256_blendv_epi8(items2, items1, greater);
+            items1 = lower;
+
+            LAYER(items1, 0x4E, 0xF0); LAYER(items2, 0x4E, 0xF0);
+            LAYER(items1, 0xB1, 0xCC); LAYER(items2, 0xB1, 0xCC);
+
+            KEY(items1); KEY(items2);
+
+            #undef LAYER
+            #undef KEY
+
+            _mm256_maskstore_epi64((long long *)range.start, mask1, items1);
+            _mm256_maskstore_epi64((long long *)range.start + 4, mask2, items2);
+        }
+    }
+
+    // 4-8 32-bit keys in two SSE4.1 registers, for CPUs without AVX2
+    template <typename T>
+    __attribute__((target("sse4.1")))
+    void SortNetworksSSE41_32(T *first, Wiki::Iterator iterator) {
+        const __m128i sign = _mm_set1_epi32(std::numeric_limits<int32_t>::min());
+
+        iterator.begin();
+        while (!iterator.finished()) {
+            Range<T*> range = iterator.nextRange(first);
+
+            // there's no masked load or store, so go through a padded copy of the group
+            T group[8];
+            std::fill(group, group + 8, std::numeric_limits<T>::max());
+            std::copy(range.start, range.end, group);
+
+            if (std::is_floating_point<T>::value &&
+                std::find_if(range.start, range.end, IsZeroOrNaN<T>) != range.end) {
+                SortNetwork(range, std::less<T>());
+                continue;
+            }
+
+            __m128i items1 = _mm_loadu_si128((const __m128i *)group);
+            __m128i items2 = _mm_loadu_si128((const __m128i *)group + 1);
+
+            #define KEY(items) \
+                if (std::is_floating_point<T>::value) { \
+                    items = _mm_xor_si128(items, _mm_srli_epi32(_mm_srai_epi32(items, 31), 1)); \
+                } else if (std::is_unsigned<T>::value) { \
+                    items = _mm_xor_si128(items, sign); }
+
+            #define LAYER(items, order, maxima) { \
+                __m128i other = _mm_shuffle_epi32(items, order); \
+                items = _mm_blend_epi16(_mm_min_epi32(items, other), _mm_max_epi32(items, other), maxima); }
+
+            KEY(items1); KEY(items2);
+
+            LAYER(items1, 0xB1, 0xCC); LAYER(items2, 0xB1, 0xCC);
+            LAYER(items1, 0x4E, 0xF0); LAYER(items2, 0x4E, 0xF0);
+            LAYER(items1, 0xD8, 0x30); LAYER(items2, 0xD8, 0x30);
+
+            items2 = _mm_shuffle_epi32(items2, 0x1B);
+            __m128i lower = _mm_min_epi32(items1, items2);
+            items2 = _mm_max_epi32(items1, items2);
+            items1 = lower;
+
+            LAYER(items1, 0x4E, 0xF0); LAYER(items2, 0x4E, 0xF0);
+            LAYER(items1, 0xB1, 0xCC); LAYER(items2, 0xB1, 0xCC);
+
+            KEY(items1); KEY(items2);
+
+            #undef LAYER
+            #undef KEY
+
+            _mm_storeu_si128((__m128i *)group, items1);
+            _mm_storeu_si128((__m128i *)group + 1, items2);
+            std::copy(group, group + range.length(), range.start);
+        }
+    }
+#endif
+
+    // pick a SIMD sorting network kernel for this key type, based on what the CPU supports,
+    // or return null if there isn't one
+    template <typename T, std::size_t Bytes = (std::is_arithmetic<T>::value && !std::is_same<T, bool>::value) ? sizeof(T) : 0>
+    struct NetworkKernel {
+        static void (*select())(T *, Wiki::Iterator) {
+            return 0;
+        }
+    };
+
+#if WIKI_X86_SIMD
+    template <typename T>
+    struct NetworkKernel<T, 4> {
+        static void (*select())(T *, Wiki::Iterator) {
+            static const bool avx2 = __builtin_cpu_supports("avx2");
+            static const bool sse41 = __builtin_cpu_supports("sse4.1");
+
+            if (avx2) return SortNetworksAVX2_32<T>;
+            if (sse41) return SortNetworksSSE41_32<T>;
+            return 0;
+        }
+    };
+
+    template <typename T>
+    struct NetworkKernel<T, 8> {
+        static void (*select())(T *, Wiki::Iterator) {
+            static const bool avx2 = __builtin_cpu_supports("avx2");
+
+            if (avx2) return SortNetworksAVX2_64<T>;
+            return 0;
+        }
+    };
+#endif
+
+    // only raw arrays can be loaded straight into registers, and only std::less matches the min/max instructions
+    template <typename RandomAccessIterator, typename Comparison>
+    bool SortNetworksSIMD(RandomAccessIterator first, Wiki::Iterator iterator, Comparison) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        if (!IsContiguous<RandomAccessIterator>::value || !IsLess<Comparison, T>::value) return false;
+
+        void (*kernel)(T *, Wiki::Iterator) = NetworkKernel<T>::select();
+        if (!kernel) return false;
+
+        kernel(&*first, iterator);
+        return true;
+    }
+
+    // sort groups of 4-8 items at a time using the sorting networks above
+    template <typename RandomAccessIterator, typename Comparison, typename Counters = NoCounters>
+    void SortNetworks(RandomAccessIterator first, Wiki::Iterator iterator, Comparison compare, Counters counters = Counters()) {
+        if (SortNetworksSIMD(first, iterator, compare)) return;
+
+        iterator.begin();
+        while (!iterator.finished()) {
+            SortNetwork(iterator.nextRange(first), compare, counters);
+        }
+    }
+
+    // customization point for the radix sort: specialize RadixKey for an item type and the comparison that orders it,
+    // with value = true, an unsigned integer type Bits, and a static function bits(item) that returns a Bits value
+    // where compare(item1, item2) == (bits(item1) < bits(item2))
+    // (the items also need to be trivially copyable, since the radix sort copies them between the array and the cache)
+    template <typename T, typename Comparison>
+    struct RadixKey {
+        static const bool value = false;
+    };
+
+    template <typename T, bool Integral = std::is_integral<T>::value, bool Floating = std::is_floating_point<T>::value>
+    struct ArithmeticRadixKey {
+        static const bool value = false;
+    };
+
+    // the sign bit of signed integers is flipped, so the negative numbers come first
+    template <typename T>
+    struct ArithmeticRadixKey<T, true, false> {
+        static const bool value = true;
+        typedef typename std::make_unsigned<T>::type Bits;
+
+        static Bits bits(T item) {
+            if (!std::is_signed<T>::value) return item;
+            return (Bits)item ^ ((Bits)1 << (sizeof(Bits) * 8 - 1));
+        }
+    };
+
+    template <>
+    struct ArithmeticRadixKey<bool, true, false> {
+        static const bool value = false;
+    };
+
+    // negative floating-point numbers have every bit flipped and positive numbers only have their sign bit flipped,
+    // and -0.0 uses the same key as 0.0 since they're equal
+    template <typename T>
+    struct ArithmeticRadixKey<T, false, true> {
+        static const bool value = std::numeric_limits<T>::is_iec559 && (sizeof(T) == 4 || sizeof(T) == 8);
+        typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type Bits;
+
+        static Bits bits(T item) {
+            const Bits sign = (Bits)1 << (sizeof(Bits) * 8 - 1);
+            if (item == 0) return sign;
+
+            Bits bits;
+            std::memcpy(&bits, &item, sizeof(bits));
+            return (bits & sign) ? ~bits : (bits | sign);
+        }
+    };
+
+    template <typename T>
+    struct RadixKey<T, std::less<T> > : ArithmeticRadixKey<T> {};
+
+#if __cplusplus >= 201402L
+    template <typename T>
+    struct RadixKey<T, std::less<> > : ArithmeticRadixKey<T> {};
+#endif
+
+    // move each item to its place for this byte of the keys, counting up from the starting offset of each byte value
+    template <typename Key, typename Iterator1, typename Iterator2>
+    void RadixScatter(Iterator1 first, Iterator1 last, Iterator2 out, std::size_t offsets[256], std::size_t shift) {
+        for (; first != last; ++first) {
+            out[offsets[(Key::bits(*first) >> shift) & 255]++] = *first;
+        }
+    }
+
+    // stable LSD radix sort, one byte of the keys at a time, moving the items back and forth between the range
+    // and the cache (which needs to be at least as large as the range)
+    template <typename RandomAccessIterator, typename Comparison>
+    void RadixSort(RandomAccessIterator first, RandomAccessIterator last,
+                   typename std::iterator_traits<RandomAccessIterator>::value_type *cache, Comparison) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        typedef RadixKey<T, Comparison> Key;
+        typedef typename Key::Bits Bits;
+        const std::size_t size = last - first;
+
+        // count every byte of every key in one pass
+        std::size_t counts[sizeof(Bits)][256] = {};
+        for (RandomAccessIterator index = first; index != last; ++index) {
+            Bits bits = Key::bits(*index);
+            for (std::size_t digit = 0; digit < sizeof(Bits); digit++)
+                counts[digit][(bits >> (digit * 8)) & 255]++;
+        }
+
+        const Bits first_bits = Key::bits(*first);
+        bool in_cache = false;
+        for (std::size_t digit = 0; digit < sizeof(Bits); digit++) {
+            // skip any byte that's the same for every item, since that pass wouldn't change anything
+            if (counts[digit][(first_bits >> (digit * 8)) & 255] == size) continue;
+
+            std::size_t offsets[256], offset = 0;
+            for (std::size_t value = 0; value < 256; value++) {
+                offsets[value] = offset;
+                offset += counts[digit][value];
+            }
+
+            if (in_cache) RadixScatter<Key>(cache, cache + size, first, offsets, digit * 8);
+            else RadixScatter<Key>(first, last, cache, offsets, digit * 8);
+            in_cache = !in_cache;
+        }
+
+        if (in_cache) std::copy(cache, cache + size, first);
+    }
+
+    // radix sort every range within this level of the merge sort
+    template <typename RandomAccessIterator, typename Comparison>
+    void RadixSortLevel(RandomAccessIterator first, Wiki::Iterator iterator,
+                        typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                        Comparison compare, std::true_type) {
+        iterator.begin();
+        while (!iterator.finished()) {
+            Range<RandomAccessIterator> range = iterator.nextRange(first);
+            RadixSort(range.start, range.end, cache, compare);
+        }
+    }
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void RadixSortLevel(RandomAccessIterator, Wiki::Iterator,
+                        typename std::iterator_traits<RandomAccessIterator>::value_type *,
+                        Comparison, std::false_type) {}
+
+    template <typename T, typename Comparison>
+    struct IsRadix {
+        static const bool value = RadixKey<T, Comparison>::value && std::is_trivially_copyable<T>::value;
+    };
+
+    // whether Sort can use the radix sort for these items, and if so the level of the merge sort where the ranges
+    // will be radix sorted in the cache (the whole array if it fits, otherwise the ranges get merged from there)
+    // the ranges need to be large enough that counting and moving them a byte at a time is faster than merging,
+    // and the merges are faster when the items are already mostly in ascending or descending order
+    template <typename RandomAccessIterator, typename Comparison>
+    std::size_t RadixLevel(RandomAccessIterator first, RandomAccessIterator last, std::size_t cache_size, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        const std::size_t size = last - first;
+        if (!IsRadix<T, Comparison>::value) return 0;
+        if (size < 1024) return 0;
+
+        // checking every 16th pair of neighboring items is enough to tell
+        const std::size_t samples = size/16;
+        std::size_t ascending = 0, descending = 0;
+        for (RandomAccessIterator index = first + 1; index < last; index += 16) {
+            ascending += compare(*(index - 1), *index);
+            descending += compare(*index, *(index - 1));
+            if (ascending >= samples/8 && descending >= samples/8) break;
+        }
+        if (ascending < samples/8 || descending < samples/8) return 0;
+
+        if (cache_size >= size) return Hyperfloor(size);
+
+        std::size_t level = Hyperfloor(cache_size)/2;
+        return (level >= 512) ? level : 0;
+    }
+
+    // the level of the merge sort that segmented iterators sort through pointers into the cache: the largest level whose
+    // ranges fit into half of the cache, so the other half can be the cache for sorting them (or the whole array if it fits),
+    // or 0 for iterators that aren't segmented or a cache that's too small for it to be worth it
+    template <typename RandomAccessIterator>
+    std::size_t SegmentLevel(std::size_t size, std::size_t cache_size) {
+        if (!Segments<RandomAccessIterator>::value || cache_size < 128) return 0;
+        if (size <= cache_size/2) return Hyperfloor(size);
+        return Hyperfloor(cache_size/4);
+    }
+
+    // merge each A+B combination within the current level of the merge sort
+    // returns true if it merged two levels at the same time, in which case the caller needs to skip a level
+    template <typename RandomAccessIterator, typename RangeIterator, typename Comparison, typename Counters = NoCounters>
+    bool MergeLevel(RandomAccessIterator first, RangeIterator iterator,
+                    typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                    std::size_t cache_size, Comparison compare, Counters counters = Counters()) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        // if every A block will fit into the cache, use a special branch specifically for merging with the cache
+        // (so a cache of half the array is enough to merge the top level this way too)
+        if (iterator.max_length() <= cache_size) {
+            counters.phase(CacheMergePhase);
+
+            // if four subarrays fit into the cache, it's faster to merge both pairs of subarrays into the cache,
+            // then merge the two merged subarrays from the cache back into the original array
+            // (those merges don't gallop, so expensive comparisons always merge one level at a time)
+            if ((iterator.length() + 1) * 4 <= cache_size && iterator.count() >= 4 && !IsExpensive<Comparison>::value) {
+                iterator.begin();
+                while (!iterator.finished()) {
+                    // merge A1 and B1 into the cache
+                    Range<RandomAccessIterator> A1 = iterator.nextRange(first);
+                    Range<RandomAccessIterator> B1 = iterator.nextRange(first);
+                    Range<RandomAccessIterator> A2 = iterator.nextRange(first);
+                    Range<RandomAccessIterator> B2 = iterator.nextRange(first);
+
+                    if (compare(*(B1.end - 1), *A1.start)) {
+                        // the two ranges are in reverse order, so move them in reverse order into the cache
+                        MoveToCache(A1.start, A1.end, cache + B1.length());
+                        MoveToCache(B1.start, B1.end, cache);
+                    } else if (compare(*B1.start, *(A1.end - 1))) {
+                        // these two ranges weren't already in order, so merge them into the cache
+                        MergeIntoCache(A1.start, A1.end, B1.start, B1.end, cache, compare);
+                    } else {
+                        // if A1, B1, A2, and B2 are all in order, skip doing anything else
+                        if (!compare(*B2.start, *(A2.end - 1)) &&
+                            !compare(*A2.start, *(B1.end - 1))) continue;
+
+                        // move A1 and B1 into the cache in the same order at once
+                        MoveToCache(A1.start, B1.end, cache);
+                    }
+                    A1 = Range<RandomAccessIterator>(A1.start, B1.end);
+                    counters.count(Moves, A1.length());
+
+                    // merge A2 and B2 into the cache
+                    if (compare(*(B2.end - 1), *A2.start)) {
+                        // the two ranges are in reverse order, so move them in reverse order into the cache
+                        MoveToCache(A2.start, A2.end, cache + A1.length() + B2.length());
+                        MoveToCache(B2.start, B2.end, cache + A1.length());
+                    } else if (compare(*B2.start, *(A2.end - 1))) {
+                        // these two ranges weren't already in order, so merge them into the cache
+                        MergeIntoCache(A2.start, A2.end, B2.start, B2.end, cache + A1.length(), compare);
+                    } else {
+                        // move A2 and B2 into the cache in the same order at once
+                        MoveToCache(A2.start, B2.end, cache + A1.length());
+                    }
+                    A2 = Range<RandomAccessIterator>(A2.start, B2.end);
+                    counters.count(Moves, A2.length());
+
+                    // merge A1 and A2 from the cache into the array
+                    Range<T*> A3(cache, cache + A1.length());
+                    Range<T*> B3(cache + A1.length(), cache + A1.length() + A2.length());
+
+                    if (compare(*(B3.end - 1), *A3.start)) {
+                        // the two ranges are in reverse order, so move them in reverse order into the array
+                        std::move(A3.start, A3.end, A1.start + A2.length());
+                        std::move(B3.start, B3.end, A1.start);
+                    } else if (compare(*B3.start, *(A3.end - 1))) {
+                        // these two ranges weren't already in order, so merge them back into the array
+                        MergeInto(A3.start, A3.end, B3.start, B3.end, A1.start, compare);
+                    } else {
+                        // move A3 and B3 into the array in the same order at once
+                        std::move(A3.start, B3.end, A1.start);
+                    }
+                    counters.count(Moves, A3.length() + B3.length());
+                    DestroyCache(A3.start, B3.end);
+                }
+
+                // we merged two levels at the same time, so we're done with this level already
+                return true;
+
+            } else {
+                iterator.begin();
+                while (!iterator.finished()) {
+                    Range<RandomAccessIterator> A = iterator.nextRange(first);
+                    Range<RandomAccessIterator> B = iterator.nextRange(first);
+
+                    if (compare(*(B.end - 1), *A.start)) {
+                        // the two ranges are in reverse order, so a simple rotation should fix it
+                        Rotate(A.start, A.end, B.end, cache, cache_size, counters);
+                    } else if (compare(*B.start, *(A.end - 1))) {
+                        // these two ranges weren't already in order, so we'll need to merge them!
+                        MoveToCache(A.start, A.end, cache);
+                        counters.count(Moves, A.length());
+                        MergeExternal(A.start, A.end, B.start, B.end, cache, compare, counters);
+                    }
+                }
+            }
+        } else {
+            // this is where the in-place merge logic starts!
+            // 1. pull out two internal buffers each containing √A unique values
+            //     1a. adjust block_size and buffer_size if we couldn't find enough unique values
+            // 2. loop over the A and B subarrays within this level of the merge sort
+            //     3. break A and B into blocks of size 'block_size'
+            //     4. "tag" each of the A blocks with values from the first internal buffer
+            //     5. roll the A blocks through the B blocks and drop/rotate them where they belong
+            //     6. merge each A block with any B values that follow, using the cache or the second internal buffer
+            // 7. sort the second internal buffer if it exists
+            // 8. redistribute the two internal buffers back into the array
+
+            counters.phase(PullPhase);
+            std::size_t block_size = std::sqrt(iterator.length());
+            std::size_t buffer_size = iterator.length()/block_size + 1;
+
+            // as an optimization, we really only need to pull out the internal buffers once for each level of merges
+            // after that we can reuse the same buffers over and over, then redistribute it when we're finished with this level
+            Range<RandomAccessIterator> buffer1(first, first);
+            Range<RandomAccessIterator> buffer2(first, first);
+            RandomAccessIterator index, last;
+            std::size_t count, pull_index = 0;
+            struct
+            {
+                RandomAccessIterator from, to;
+                std::size_t count;
+                Range<RandomAccessIterator> range;
+            } pull[2];
+            for (pull_index = 0; pull_index < 2; ++pull_index) {
+                pull[pull_index].from = pull[pull_index].to = first;
+                pull[pull_index].count = 0;
+                pull[pull_index].range = Range<RandomAccessIterator>(first, first);
+            }
+            pull_index = 0;
+
+            // find two internal buffers of size 'buffer_size' each
+            // let's try finding both buffers at the same time from a single A or B subarray
+            std::size_t find = buffer_size + buffer_size;
+            bool find_separately = false;
+
+            if (block_size <= cache_size) {
+                // if every A block fits into the cache then we won't need the second internal buffer,
+                // so we really only need to find 'buffer_size' unique values
+                find = buffer_size;
+            } else if (find > iterator.length()) {
+                // we can't fit both buffers into the same A or B subarray, so find two buffers separately
+                find = buffer_size;
+                find_separately = true;
+            }
+
+            // we need to find either a single contiguous space containing 2√A unique values (which will be split up into two buffers of size √A each),
+            // or we need to find one buffer of < 2√A unique values, and a second buffer of √A unique values,
+            // OR if we couldn't find that many unique values, we need the largest possible buffer we can get
+
+            // in the case where it couldn't find a single buffer of at least √A unique values,
+            // all of the Merge steps must be replaced by a different merge algorithm (MergeInPlace)
+
+            iterator.begin();
+            while (!iterator.finished()) {
+                Range<RandomAccessIterator> A = iterator.nextRange(first);
+                Range<RandomAccessIterator> B = iterator.nextRange(first);
+
+                // just store information about where the values will be pulled from and to,
+                // as well as how many values there are, to create the two internal buffers
+                #define PULL(_to) \
+                    pull[pull_index].range = Range<RandomAccessIterator>(A.start, B.end); \
+                    pull[pull_index].count = count; \
+                    pull[pull_index].from = index; \
+                    pull[pull_index].to = _to
+
+                // check A for the number of unique values we need to fill an internal buffer
+                // these values will be pulled out to the start of A
+                for (last = A.start, count = 1; count < find; last = index, ++count) {
+                    index = FindLastForward(last + 1, A.end, *last, compare, find - count);
+                    counters.count(Searches);
+                    if (index == A.end) break;
+                    assert(index < A.end);
+                }
+                index = last;
+
+                if (count >= buffer_size) {
+                    // keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer
+                    PULL(A.start);
+                    pull_index = 1;
+
+                    if (count == buffer_size + buffer_size) {
+                        // we were able to find a single contiguous section containing 2√A unique values,
+                        // so this section can be used to contain both of the internal buffers we'll need
+                        buffer1 = Range<RandomAccessIterator>(A.start, A.start + buffer_size);
+                        buffer2 = Range<RandomAccessIterator>(A.start + buffer_size, A.start + count);
+                        break;
+                    } else if (find == buffer_size + buffer_size) {
+                        // we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values,
+                        // so we still need to find a second separate buffer of at least √A unique values
+                        buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
+                        find = buffer_size;
+                    } else if (block_size <= cache_size) {
+                        // we found the first and only internal buffer that we need, so we're done!
+                        buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
+                        break;
+                    } else if (find_separately) {
+                        // found one buffer, but now find the other one
+                        buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
+                        find_separately = false;
+                    } else {
+                        // we found a second buffer in an 'A' subarray containing √A unique values, so we're done!
+                        buffer2 = Range<RandomAccessIterator>(A.start, A.start + count);
+                        break;
+                    }
+                } else if (pull_index == 0 && count > buffer1.length()) {
+                    // keep track of the largest buffer we were able to find
+                    buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
+                    PULL(A.start);
+                }
+
+                // check B for the number of unique values we need to fill an internal buffer
+                // these values will be pulled out to the end of B
+                    for (last = B.end - 1, count = 1; count < find; last = index - 1, ++count) {
+                        index = FindFirstBackward(B.start, last, *last, compare, find - count);
+                        counters.count(Searches);
+                        if (index == B.start) break;
+                        assert(index > B.start);
+                    }
+                    index = last;
+
+                if (count >= buffer_size) {
+                    // keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer
+                    PULL(B.end);
+                    pull_index = 1;
+
+                    if (count == buffer_size + buffer_size) {
+                        // we were able to find a single contiguous section containing 2√A unique values,
+                        // so this section can be used to contain both of the internal buffers we'll need
+                        buffer1 = Range<RandomAccessIterator>(B.end - count, B.end - buffer_size);
+                        buffer2 = Range<RandomAccessIterator>(B.end - buffer_size, B.end);
+                        break;
+                    } else if (find == buffer_size + buffer_size) {
+                        // we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values,
+                        // so we still need to find a second separate buffer of at least √A unique values
+                        buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
+                        find = buffer_size;
+                    } else if (block_size <= cache_size) {
+                        // we found the first and only internal buffer that we need, so we're done!
+                        buffer1 = Range<RandomAccessIterator>(B.end - count, B.end );
+                        break;
+                    } else if (find_separately) {
+                        // found one buffer, but now find the other one
+                        buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
+                        find_separately = false;
+                    } else {
+                        // buffer2 will be pulled out from a 'B' subarray, so if the first buffer was pulled out from the corresponding 'A' subarray,
+                        // we need to adjust the end point for that A subarray so it knows to stop redistributing its values before reaching buffer2
+                        if (pull[0].range.start == A.start) {
+                            pull[0].range.end -= pull[1].count;
+                        }
+
+                        // we found a second buffer in a 'B' subarray containing √A unique values, so we're done!
+                        buffer2 = Range<RandomAccessIterator>(B.end - count, B.end);
+                        break;
+                    }
+                } else if (pull_index == 0 && count > buffer1.length()) {
+                    // keep track of the largest buffer we were able to find
+                    buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
+                    PULL(B.end);
+                }
+
+                #undef PULL
+            }
+
+            // pull out the two ranges so we can use them as internal buffers
+            for (pull_index = 0; pull_index < 2; ++pull_index) {
+                std::size_t length = pull[pull_index].count;
+
+                if (pull[pull_index].to < pull[pull_index].from) {
+                    // we're pulling the values out to the left, which means the start of an A subarray
+                    index = pull[pull_index].from;
+                    for (count = 1; count < length; ++count) {
+                        index = FindFirstBackward(pull[pull_index].to, pull[pull_index].from - (count - 1),
+                                                  *(index - 1), compare, length - count);
+                        counters.count(Searches);
+                        Range<RandomAccessIterator> range(index + 1, pull[pull_index].from + 1);
+                        Rotate(range.start, range.end - count, range.end, cache, cache_size, counters);
+                        pull[pull_index].from = index + count;
+                    }
+                } else if (pull[pull_index].to > pull[pull_index].from) {
+                    // we're pulling values out to the right, which means the end of a B subarray
+                    index = pull[pull_index].from + 1;
+                    for (count = 1; count < length; ++count) {
+                        index = FindLastForward(index, pull[pull_index].to, *index,
+                                                compare, length - count);
+                        counters.count(Searches);
+                        Range<RandomAccessIterator> range(pull[pull_index].from, index - 1);
+                        Rotate(range.start, range.start + count, range.end, cache, cache_size, counters);
+                        pull[pull_index].from = index - count - 1;
+                    }
+                }
+            }
+
+            // adjust block_size and buffer_size based on the values we were able to pull out
+            buffer_size = buffer1.length();
+            block_size = iterator.length() / buffer_size + 1;
+
+            // the first buffer NEEDS to be large enough to tag each of the evenly sized A blocks,
+            // so this was originally here to test the math for adjusting block_size above
+            //assert((iterator.length() + 1)/block_size <= buffer_size);
+
+            // now that the two internal buffers have been created, it's time to merge each A+B combination at this level of the merge sort!
+            iterator.begin();
+            while (!iterator.finished()) {
+                Range<RandomAccessIterator> A = iterator.nextRange(first);
+                Range<RandomAccessIterator> B = iterator.nextRange(first);
+
+                // remove any parts of A or B that are being used by the internal buffers
+                RandomAccessIterator start = A.start;
+                if (start == pull[0].range.start) {
+                    if (pull[0].from > pull[0].to) {
+                        A.start += pull[0].count;
+
+                        // if the internal buffer takes up the entire A or B subarray, then there's nothing to merge
+                        // this only happens for very small subarrays, like √4 = 2, 2 * (2 internal buffers) = 4,
+                        // which also only happens when cache_size is small or 0 since it'd otherwise use MergeExternal
+                        if (A.length() == 0) continue;
+                    } else if (pull[0].from < pull[0].to) {
+                        B.end -= pull[0].count;
+                        if (B.length() == 0) continue;
+                    }
+                }
+                if (start == pull[1].range.start) {
+                    if (pull[1].from > pull[1].to) {
+                        A.start += pull[1].count;
+                        if (A.length() == 0) continue;
+                    } else if (pull[1].from < pull[1].to) {
+                        B.end -= pull[1].count;
+                        if (B.length() == 0) continue;
+                    }
+                }
+
+                counters.phase(LocalMergePhase);
+                if (compare(*(B.end - 1), *A.start)) {
+                    // the two ranges are in reverse order, so a simple rotation should fix it
+                    Rotate(A.start, A.end, B.end, cache, cache_size, counters);
+                } else if (compare(*A.end, *(A.end - 1))) {
+                    // these two ranges weren't already in order, so we'll need to merge them!
+                    counters.phase(BlockPhase);
+
+                    // break the remainder of A into blocks. firstA is the uneven-sized first A block
+                    Range<RandomAccessIterator> blockA(A);
+                    Range<RandomAccessIterator> firstA(A.start, A.start + blockA.length() % block_size);
+
+                    // swap the first value of each A block with the values in buffer1
+                    for (RandomAccessIterator indexA = buffer1.start, index = firstA.end;
+                         index < blockA.end;
+                         ++indexA, index += block_size) {
+                        std::iter_swap(indexA, index);
+                        counters.count(Swaps);
+                    }
+
+                    // start rolling the A blocks through the B blocks!
+                    // when we leave an A block behind we'll need to merge the previous A block with any B blocks that follow it, so track that information as well
+                    Range<RandomAccessIterator> lastA (firstA);
+                    Range<RandomAccessIterator> lastB (first, first);
+                    Range<RandomAccessIterator> blockB (B.start, B.start + std::min(block_size, B.length()));
+                    blockA.start += firstA.length();
+                    RandomAccessIterator indexA = buffer1.start;
+
+                    // expensive comparisons track the original order of the rolling A blocks as they're swapped around,
+                    // so the minimum A block is found by looking for the next rank rather than by comparing the tags
+                    const std::size_t max_ranks = 512;
+                    unsigned short ranks[max_ranks];
+                    std::size_t rank_count = blockA.length() / block_size, dropped = 0;
+                    const bool ranked = IsExpensive<Comparison>::value && rank_count <= max_ranks;
+                    if (ranked) for (std::size_t index = 0; index < rank_count; ++index) ranks[index] = index;
+
+                    // if the first unevenly sized A block fits into the cache, move it there for when we go to Merge it
+                    // otherwise, if the second buffer is available, block swap the contents into that
+                    if (lastA.length() <= cache_size) {
+                        MoveToCache(lastA.start, lastA.end, cache);
+                        counters.count(Moves, lastA.length());
+                    } else if (buffer2.length() > 0) {
+                        std::swap_ranges(lastA.start, lastA.end, buffer2.start);
+                        counters.count(Swaps, lastA.length());
+                    }
+
+                    if (blockA.length() > 0) {
+                        while (true) {
+                            // if there's a previous B block and the first value of the minimum A block is <= the last value of the previous B block,
+                            // then drop that minimum A block behind. or if there are no B blocks left then keep dropping the remaining A blocks.
+                            if ((lastB.length() > 0 && !compare(*(lastB.end - 1), *indexA)) ||
+                                blockB.length() == 0) {
+                                // figure out where to split the previous B block, and rotate it at the split
+                                RandomAccessIterator B_split = std::lower_bound(lastB.start, lastB.end, *indexA, compare);
+                                std::size_t B_remaining = std::distance(B_split, lastB.end);
+                                counters.count(Searches);
+
+                                // swap the minimum A block to the beginning of the rolling A blocks
+                                RandomAccessIterator minA = blockA.start;
+                                if (ranked) {
+                                    std::size_t min_rank = 0;
+                                    while (ranks[min_rank] != dropped) ++min_rank;
+                                    minA = blockA.start + min_rank * block_size;
+
+                                    // the first A block takes the minimum A block's place, and the rest shift down as it's dropped
+                                    ranks[min_rank] = ranks[0];
+                                    std::copy(ranks + 1, ranks + rank_count, ranks);
+                                    --rank_count;
+                                    ++dropped;
+                                } else {
+                                    for (RandomAccessIterator findA = minA + block_size ; findA < blockA.end ; findA += block_size) {
+                                        if (compare(*findA, *minA)) {
+                                            minA = findA;
+                                        }
+                                    }
+                                }
+                                std::swap_ranges(blockA.start, blockA.start + block_size, minA);
+                                counters.count(Swaps, block_size + 1);
+
+                                // swap the first item of the previous A block back with its original value, which is stored in buffer1
+                                std::iter_swap(blockA.start, indexA);
+                                ++indexA;
+
+                                // locally merge the previous A block with the B values that follow it
+                                // if lastA fits into the external cache we'll use that (with MergeExternal),
+                                // or if the second internal buffer exists we'll use that (with MergeInternal),
+                                // or failing that we'll use a strictly in-place merge algorithm (MergeInPlace)
+                                counters.phase(LocalMergePhase);
+                                if (lastA.length() <= cache_size) {
+                                    MergeExternal(lastA.start, lastA.end, lastA.end, B_split, cache, compare, counters);
+                                } else if (buffer2.length() > 0) {
+                                    MergeInternal(lastA.start, lastA.end, lastA.end, B_split, buffer2.start, compare, counters);
+                                } else {
+                                    MergeInPlace(lastA.start, lastA.end, lastA.end, B_split, cache, cache_size, compare, counters);
+                                }
+                                counters.phase(BlockPhase);
+
+                                if (buffer2.length() > 0 || block_size <= cache_size) {
+                                    // move the previous A block into the cache or buffer2, since that's where we need it to be when we go to merge it anyway
+                                    if (block_size <= cache_size) {
+                                        MoveToCache(blockA.start, blockA.start + block_size, cache);
+                                        counters.count(Moves, block_size);
+                                    } else {
+                                        std::swap_ranges(blockA.start, blockA.start + block_size, buffer2.start);
+                                        counters.count(Swaps, block_size);
+                                    }
+
+                                    // this is equivalent to rotating, but faster
+                                    // the area normally taken up by the A block is either the contents of buffer2, or items we don't need anymore since we moved them out
+                                    // either way we don't need to retain the order of those items, so instead of rotating we can just block swap B to where it belongs
+                                    std::swap_ranges(B_split, B_split + B_remaining, blockA.start + block_size - B_remaining);
+                                    counters.count(Swaps, B_remaining);
+                                } else {
+                                    // we are unable to use the 'buffer2' trick to speed up the rotation operation since buffer2 doesn't exist, so perform a normal rotation
+                                    Rotate(B_split, blockA.start, blockA.start + block_size, cache, cache_size, counters);
+                                }
+
+                                // update the range for the remaining A blocks, and the range remaining from the B block after it was split
+                                lastA = Range<RandomAccessIterator>(blockA.start - B_remaining, blockA.start - B_remaining + block_size);
+                                lastB = Range<RandomAccessIterator>(lastA.end, lastA.end + B_remaining);
+
+                                // if there are no more A blocks remaining, this step is finished!
+                                blockA.start += block_size;
+                                if (blockA.length() == 0) break;
+
+                            } else if (blockB.length() < block_size) {
+                                // move the last B block, which is unevenly sized, to before the remaining A blocks, by using a rotation
+                                // (the cache might be holding the previous A block, so the rotation can't use it)
+                                Rotate(blockA.start, blockB.start, blockB.end, cache, 0, counters);
+
+                                lastB = Range<RandomAccessIterator>(blockA.start, blockA.start + blockB.length());
+                                blockA.start += blockB.length();
+                                blockA.end += blockB.length();
+                                blockB.end = blockB.start;
+                            } else {
+                                // roll the leftmost A block to the end by swapping it with the next B block
+                                std::swap_ranges(blockA.start, blockA.start + block_size, blockB.start);
+                                counters.count(Swaps, block_size);
+                                lastB = Range<RandomAccessIterator>(blockA.start, blockA.start + block_size);
+
+                                blockA.start += block_size;
+                                blockA.end += block_size;
+                                blockB.start += block_size;
+                                if (ranked) std::rotate(ranks, ranks + 1, ranks + rank_count);
+
+                                if (blockB.end > B.end - block_size) {
+                                    blockB.end = B.end;
+                                } else {
+                                    blockB.end += block_size;
+                                }
+                            }
+                        }
+                    }
+
+                    // merge the last A block with the remaining B values
+                    counters.phase(LocalMergePhase);
+                    if (lastA.length() <= cache_size) {
+                        MergeExternal(lastA.start, lastA.end, lastA.end, B.end, cache, compare, counters);
+                    } else if (buffer2.length() > 0) {
+                        MergeInternal(lastA.start, lastA.end, lastA.end, B.end, buffer2.start, compare, counters);
+                    } else {
+                        MergeInPlace(lastA.start, lastA.end, lastA.end, B.end, cache, cache_size, compare, counters);
+                    }
+                }
+            }
+
+            // when we're finished with this merge step we should have the one or two internal buffers left over, where the second buffer is all jumbled up
+            // insertion sort the second buffer, then redistribute the buffers back into the array using the opposite process used for creating the buffer
+
+            // while an unstable sort like std::sort could be applied here, in benchmarks it was consistently slightly slower than a simple insertion sort,
+            // even for tens of millions of items. this may be because insertion sort is quite fast when the data is already somewhat sorted, like it is here
+            counters.phase(Buffer2Phase);
+            if (IsExpensive<Comparison>::value) BinaryInsertionSort(buffer2.start, buffer2.end, compare, counters);
+            else InsertionSort(buffer2.start, buffer2.end, compare, counters);
+
+            counters.phase(RedistributePhase);
+
+            for (pull_index = 0 ; pull_index < 2 ; ++pull_index) {
+                std::size_t unique = pull[pull_index].count * 2;
+                if (pull[pull_index].from > pull[pull_index].to) {
+                    // the values were pulled out to the left, so redistribute them back to the right
+                    Range<RandomAccessIterator> buffer(
+                        pull[pull_index].range.start,
+                        pull[pull_index].range.start + pull[pull_index].count
+                    );
+                    while (buffer.length() > 0) {
+                        index = FindFirstForward(buffer.end, pull[pull_index].range.end,
+                                                 *buffer.start, compare, unique);
+                        counters.count(Searches);
+                        std::size_t amount = index - buffer.end;
+                        Rotate(buffer.start, buffer.end, index, cache, cache_size, counters);
+                        buffer.start += (amount + 1);
+                        buffer.end += amount;
+                        unique -= 2;
+                    }
+                } else if (pull[pull_index].from < pull[pull_index].to) {
+                    // the values were pulled out to the right, so redistribute them back to the left
+                    Range<RandomAccessIterator> buffer(
+                        pull[pull_index].range.end - pull[pull_index].count,
+                        pull[pull_index].range.end
+                    );
+                    while (buffer.length() > 0) {
+                        index = FindLastBackward(pull[pull_index].range.start, buffer.start,
+                                                 *(buffer.end - 1), compare, unique);
+                        counters.count(Searches);
+                        std::size_t amount = buffer.start - index;
+                        Rotate(index, index + amount, buffer.end, cache, cache_size, counters);
+                        buffer.start -= amount;
+                        buffer.end -= (amount + 1);
+                        unique -= 2;
+                    }
+                }
+            }
+        }
+
+        return false;
+    }
+
+    // merge the sorted ranges [first, middle) and [middle, last) using the same steps as a level of the merge sort
+    template <typename RandomAccessIterator, typename Comparison, typename Counters = NoCounters>
+    void MergeRange(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last,
+                    typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                    std::size_t cache_size, Comparison compare, Counters counters = Counters()) {
+        if (first == middle || middle == last) return;
+
+        // the merge level only ever moves A into the cache, so if only B fits (like when a short run follows a long one),
+        // move B into the cache and merge it in from the back instead
+        const std::size_t A_length = middle - first, B_length = last - middle;
+        if (A_length > cache_size && B_length <= cache_size) {
+            counters.phase(CacheMergePhase);
+            MoveToCache(middle, last, cache);
+            counters.count(Moves, B_length);
+            MergeExternalBackward(first, middle, middle, last, cache, compare, counters);
+            return;
+        }
+        MergeLevel(first, PairIterator(A_length, last - first), cache, cache_size, compare, counters);
+    }
+
+    // bottom-up merge sort combined with an in-place merge algorithm for O(1) memory use
+    // with a cache of at least half the array's size this is a standard merge sort, and anything smaller
+    // falls back to the in-place merges for whichever levels no longer fit into it
+    template <typename RandomAccessIterator, typename Comparison, typename Counters = NoCounters>
+    void SortLevels(RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+                    typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                    typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end,
+                    Counters counters = Counters()) {
+        const std::size_t size = std::distance(first, last);
+        counters.phase(NetworkPhase);
+
+        // if the array is of size 0, 1, 2, or 3, just sort them like so:
+        if (size < 4) {
+            if (size == 3) {
+                // hard-coded insertion sort
+                if (compare(first[1], first[0])) {
+                    std::iter_swap(first + 0, first + 1);
+                    counters.count(Swaps);
+                }
+                if (compare(first[2], first[1])) {
+                    std::iter_swap(first + 1, first + 2);
+                    counters.count(Swaps);
+                    if (compare(first[1], first[0])) {
+                        std::iter_swap(first + 0, first + 1);
+                        counters.count(Swaps);
+                    }
+                }
+            } else if (size == 2) {
+                // swap the items if they're out of order
+                if (compare(first[1], first[0])) {
+                    std::iter_swap(first + 0, first + 1);
+                    counters.count(Swaps);
+                }
+            }
+
+            return;
+        }
+
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        const std::size_t cache_size = cache_end - cache;
+
+        // plain integer or floating-point keys are faster to radix sort within the cache than to compare,
+        // so start from the largest level that fits into it (or the entire array)
+        const std::size_t radix_level = RadixLevel(first, last, cache_size, compare);
+
+        // otherwise segmented iterators like std::deque's, which pay to find the segment on every 'first + k', sort the first levels
+        // through pointers instead, by moving each range into half of the cache and sorting it there with the other half
+        typedef std::integral_constant<bool, Segments<RandomAccessIterator>::value> Segmented;
+        const std::size_t segment_level = (radix_level > 0) ? 0 : SegmentLevel<RandomAccessIterator>(size, cache_size);
+
+        // expensive comparisons binary insertion sort groups of 16-31 items instead, which takes fewer comparisons
+        // than the networks (that compare twice per exchange to stay stable) and the first few merge levels
+        const std::size_t insertion_level = std::min(Hyperfloor(size), (std::size_t)16);
+        Wiki::Iterator iterator (size, (radix_level > 0) ? radix_level : (segment_level > 0) ? segment_level :
+                                       IsExpensive<Comparison>::value ? insertion_level : 4);
+
+        if (radix_level > 0) {
+            RadixSortLevel(first, iterator, cache, compare, std::integral_constant<bool, IsRadix<T, Comparison>::value>());
+            if (iterator.length() >= size) return;
+        } else if (segment_level > 0) {
+            iterator.begin();
+            while (!iterator.finished()) {
+                Range<RandomAccessIterator> range = iterator.nextRange(first);
+                T *items_end = MoveSegmentsToCache(range.start, range.end, cache, Segmented());
+                SortLevels(cache, items_end, compare, cache + cache_size/2, cache_end, counters);
+                MoveSegmentsFromCache(cache, items_end, range.start, Segmented());
+
+                counters.phase(NetworkPhase);
+                counters.count(Moves, range.length() * 2);
+            }
+            if (iterator.length() >= size) return;
+        } else if (IsExpensive<Comparison>::value) {
+            iterator.begin();
+            while (!iterator.finished()) {
+                Range<RandomAccessIterator> range = iterator.nextRange(first);
+                BinaryInsertionSort(range.start, range.end, compare, counters);
+            }
+            if (iterator.length() >= size) return;
+        } else {
+            SortNetworks(first, iterator, compare, counters);
+            if (size < 8) return;
+        }
+
+        // then merge sort the higher levels, which can be 8-15, 16-31, 32-63, 64-127, etc.
+        while (true) {
+            // if four subarrays fit into the cache, both levels were merged at the same time,
+            // so we're done with the next level already (iterator.nextLevel() is called again below)
+            if (MergeLevel(first, iterator, cache, cache_size, compare, counters)) iterator.nextLevel();
+
+            // double the size of each A and B subarray that will be merged in the next level
+            if (!iterator.nextLevel()) break;
+        }
+    }
+
+    // whether [first, last) is already in ascending order (1), strictly descending order (-1), or neither (0)
+    // (only strictly descending items can be reversed without making the sort unstable)
+    template <typename RandomAccessIterator, typename Comparison>
+    int RunDirection(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        if (compare(*(first + 1), *first)) {
+            for (RandomAccessIterator index = first + 2; index < last; ++index)
+                if (!compare(*index, *(index - 1))) return 0;
+            return -1;
+        }
+
+        for (RandomAccessIterator index = first + 2; index < last; ++index)
+            if (compare(*index, *(index - 1))) return 0;
+        return 1;
+    }
+
+    // powersort's "power" of the boundary between the runs [start1, start2) and [start2, end2) in an array of 'size' items:
+    // how deep that boundary would be in a perfectly balanced merge tree, which is how many leading binary digits
+    // the midpoints of the two runs (as fractions of the array's size) have in common, plus one
+    inline std::size_t RunPower(std::size_t size, std::size_t start1, std::size_t start2, std::size_t end2) {
+        // twice each midpoint, so the fractions are middle1/size and middle2/size
+        std::size_t middle1 = start1 + start2, middle2 = start2 + end2, power = 0;
+        while (true) {
+            ++power;
+            bool digit1 = (middle1 >= size), digit2 = (middle2 >= size);
+            if (digit1 != digit2) return power;
+            if (digit1) {
+                middle1 -= size;
+                middle2 -= size;
+            }
+            middle1 *= 2;
+            middle2 *= 2;
+        }
+    }
+
+    // the next run to merge, starting at 'first': a run of items that are already in order (reversing it if it's
+    // strictly descending), or if there isn't one here, everything up to the next one, sorted using the merge sort
+    // only runs that contain an entire window of 'window' items are found, and checking one window at a time
+    // means that unsorted items only cost a comparison or two per window
+    template <typename RandomAccessIterator, typename Comparison, typename Counters>
+    RandomAccessIterator NextRun(RandomAccessIterator first, RandomAccessIterator last, std::size_t window, Comparison compare,
+                                 typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                                 typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end,
+                                 Counters counters) {
+        counters.phase(RunPhase);
+        for (RandomAccessIterator index = first; last - index >= (std::ptrdiff_t)window; index += window) {
+            int direction = RunDirection(index, index + window, compare);
+            if (direction == 0) continue;
+
+            // find where this run starts, and if that's after 'first', sort everything before it as its own run
+            RandomAccessIterator start = index;
+            if (direction > 0) {
+                while (start > first && !compare(*start, *(start - 1))) --start;
+            } else {
+                while (start > first && compare(*start, *(start - 1))) --start;
+            }
+            if (start > first) {
+                SortLevels(first, start, compare, cache, cache_end, counters);
+                return start;
+            }
+
+            // then find where it ends
+            RandomAccessIterator end = index + window;
+            if (direction > 0) {
+                while (end < last && !compare(*end, *(end - 1))) ++end;
+            } else {
+                while (end < last && compare(*end, *(end - 1))) ++end;
+                std::reverse(first, end);
+                counters.count(Swaps, (end - first) / 2);
+            }
+            return end;
+        }
+
+        SortLevels(first, last, compare, cache, cache_end, counters);
+        return last;
+    }
+
+    // scan the array for runs of at least √n items that are already in order, then merge them with powersort's run stack,
+    // which merges adjacent runs in roughly the order of a balanced merge tree over the runs' positions
+    // this makes presorted data close to linear, and anything without long enough runs is just one run for the merge sort
+    template <typename RandomAccessIterator, typename Comparison, typename Counters>
+    void SortRuns(RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+                  typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                  typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end,
+                  Counters counters) {
+        const std::size_t size = std::distance(first, last);
+        const std::size_t window = std::max((std::size_t)std::sqrt(size)/2, (std::size_t)32);
+        if (size < window * 8) {
+            SortLevels(first, last, compare, cache, cache_end, counters);
+            return;
+        }
+
+        // the powers on the stack are always increasing, so it never holds more runs than there are bits in a size_t
+        struct {
+            Range<RandomAccessIterator> range;
+            std::size_t power;
+        } stack[sizeof(std::size_t) * 8 + 1];
+        std::size_t stack_size = 0;
+
+        Range<RandomAccessIterator> A (first, NextRun(first, last, window, compare, cache, cache_end, counters));
+        while (A.end < last) {
+            Range<RandomAccessIterator> B (A.end, NextRun(A.end, last, window, compare, cache, cache_end, counters));
+            std::size_t power = RunPower(size, A.start - first, B.start - first, B.end - first);
+
+            while (stack_size > 0 && stack[stack_size - 1].power > power) {
+                --stack_size;
+                MergeRange(stack[stack_size].range.start, A.start, A.end, cache, cache_end - cache, compare, counters);
+                A.start = stack[stack_size].range.start;
+            }
+
+            stack[stack_size].range = A;
+            stack[stack_size].power = power;
+            ++stack_size;
+            A = B;
+        }
+
+        while (stack_size > 0) {
+            --stack_size;
+            MergeRange(stack[stack_size].range.start, A.start, A.end, cache, cache_end - cache, compare, counters);
+            A.start = stack[stack_size].range.start;
+        }
+    }
+
+    // [cache, cache_end) is used as the cache. that should be uninitialized memory like Cache<T> allocates,
+    // since items are constructed in it and destroyed again without touching whatever was there before
+    // 'counters' is the instrumentation policy: NoCounters by default, or CountOperations to count each phase's operations
+    template <typename RandomAccessIterator, typename Comparison, typename Counters = NoCounters>
+    void Sort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+              typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+              typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end,
+              Counters counters = Counters()) {
+        SortRuns(first, last, CountedComparison(compare, counters), cache, cache_end, counters);
+    }
+
+    template <typename RandomAccessIterator, typename Comparison, typename Counters = NoCounters>
+    void Sort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, Counters counters = Counters()) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        const std::size_t size = std::distance(first, last);
+
+        // the sorting networks don't need a cache
+        if (size < 8) {
+            Sort(first, last, compare, (T *)0, (T *)0, counters);
+            return;
+        }
+
+        // use a small cache to speed up some of the operations
+        // since the cache size is fixed, it's still O(1) memory!
+        // just keep in mind that making it too small ruins the point (nothing will fit into it),
+        // and making it too large also ruins the point (so much for "low memory"!)
+        // removing the cache entirely still gives 75% of the performance of a standard merge
+        // (it's raw memory rather than an array of T, so nothing is constructed until items are moved into it)
+        alignas(T) char cache_memory[StackCache<T>::size * sizeof(T)];
+        T *cache = reinterpret_cast<T *>(cache_memory);
+        const std::size_t cache_size = std::min(sizeof(cache_memory)/sizeof(T), CacheItems<T>(L1CacheBytes()));
+
+        Sort(first, last, compare, cache, cache + cache_size, counters);
+    }
+
+    // stably merge the sorted ranges [first, middle) and [middle, last), like std::inplace_merge,
+    // using the block merge from the merge sort with [cache, cache_end) as scratch space (which may be empty)
+    template <typename RandomAccessIterator, typename Comparison>
+    void InplaceMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Comparison compare,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end) {
+        if (first == middle || middle == last) return;
+
+        // items at the start of A that go before all of B, and items at the end of B that go after all of A, are already in place
+        first = std::upper_bound(first, middle, *middle, compare);
+        last = std::lower_bound(middle, last, *(middle - 1), compare);
+
+        // the merge sort only ever needs to move A into the cache, but here B is often the smaller one.
+        // if B fits into the cache a few pieces at a time, merge each piece in from the back instead of using the block merge
+        const std::size_t cache_size = cache_end - cache;
+        if (last - middle < middle - first && (std::size_t)(last - middle) <= cache_size * 4) {
+            while (middle != last) {
+                RandomAccessIterator piece = middle + std::min(cache_size, (std::size_t)(last - middle));
+                first = std::upper_bound(first, middle, *middle, compare);
+                MoveToCache(middle, piece, cache);
+                MergeExternalBackward(first, middle, middle, piece, cache, compare);
+                middle = piece;
+            }
+            return;
+        }
+        MergeRange(first, middle, last, cache, cache_size, compare);
+    }
+
+    // unlike std::inplace_merge this never allocates, and only uses the same small cache on the stack as Sort,
+    // so it's O(1) memory and still O(n) time however large the two ranges are
+    template <typename RandomAccessIterator, typename Comparison>
+    void InplaceMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        if (first == middle || middle == last) return;
+
+        alignas(T) char cache_memory[StackCache<T>::size * sizeof(T)];
+        T *cache = reinterpret_cast<T *>(cache_memory);
+        const std::size_t cache_size = std::min(sizeof(cache_memory)/sizeof(T), CacheItems<T>(L1CacheBytes()));
+        InplaceMerge(first, middle, last, compare, cache, cache + cache_size);
+    }
+
+    // sort the items appended to the end of an already sorted array, then merge them in with the rest of it,
+    // which is O(k log k + n) for k new items rather than O(n log n) for sorting the whole thing again
+    template <typename RandomAccessIterator, typename Comparison>
+    void SortAppended(RandomAccessIterator first, RandomAccessIterator sorted_end, RandomAccessIterator last, Comparison compare,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end) {
+        Sort(sorted_end, last, compare, cache, cache_end);
+        InplaceMerge(first, sorted_end, last, compare, cache, cache_end);
+    }
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void SortAppended(RandomAccessIterator first, RandomAccessIterator sorted_end, RandomAccessIterator last, Comparison compare) {
+        Sort(sorted_end, last, compare);
+        InplaceMerge(first, sorted_end, last, compare);
+    }
+
+    // a tournament tree over k sorted runs, where each internal node remembers the run that lost the match there
+    // and node 0 holds the overall winner. the leaves are runs count through 2 * count - 1 in the same layout as a heap,
+    // so taking the winner's next item only replays the log2(k) matches on the path from its leaf to the root.
+    // runs are removed from the tree as soon as they run out, so the matches never have to check for that
+    template <typename Iterator, typename Comparison>
+    class LoserTree {
+    public:
+        std::vector<Iterator> next, end;
+        std::vector<std::size_t> losers;
+        Comparison compare;
+
+        LoserTree(Comparison compare) : compare(compare) {}
+
+        // whether run1's next item goes before run2's, with ties going to the earlier run to keep the merge stable.
+        // that's one comparison either way around, since the later run only wins if its item is strictly less
+        bool beats(std::size_t run1, std::size_t run2) const {
+            const bool earlier = (run1 < run2);
+            return compare(*next[earlier ? run2 : run1], *next[earlier ? run1 : run2]) != earlier;
+        }
+
+        void build() {
+            const std::size_t count = next.size();
+            std::vector<std::size_t> winners (count * 2);
+            losers.resize(count);
+            for (std::size_t run = 0; run < count; run++) winners[count + run] = run;
+            for (std::size_t node = count - 1; node >= 1; node--) {
+                const std::size_t left = winners[node * 2], right = winners[node * 2 + 1];
+                const bool left_wins = beats(left, right);
+                winners[node] = left_wins ? left : right;
+                losers[node] = left_wins ? right : left;
+            }
+            losers[0] = winners[1];
+        }
+
+        // the winner's next item changed, so play its matches again on the way back up
+        // (written with selects rather than a swap, as which run wins each match is about as hard to predict as a coin flip)
+        void replay() {
+            std::size_t winner = losers[0];
+            for (std::size_t node = (next.size() + winner) / 2; node >= 1; node /= 2) {
+                const std::size_t loser = losers[node];
+                const bool lost = beats(loser, winner);
+                losers[node] = lost ? winner : loser;
+                winner = lost ? loser : winner;
+            }
+            losers[0] = winner;
+        }
+
+        // the winner ran out, so take it out and rebuild the tree from the runs that are left, which stay in the same order
+        void remove() {
+            next.erase(next.begin() + losers[0]);
+            end.erase(end.begin() + losers[0]);
+            build();
+        }
+
+        // the run that would win if the winner were removed, which is the best of the runs it beat on its way up
+        std::size_t runnerUp() const {
+            std::size_t best = losers[(next.size() + losers[0]) / 2];
+            for (std::size_t node = (next.size() + losers[0]) / 4; node >= 1; node /= 2)
+                if (beats(losers[node], best)) best = losers[node];
+            return best;
+        }
+    };
+
+    // stably merge k sorted runs into 'output', like std::merge but for any number of runs at once.
+    // 'runs' is a range of std::pair<first, last>, and equal items come out in the order of their runs.
+    // this takes about log2(k) comparisons per item like log2(k) passes of two-way merges, but only moves each item once,
+    // and once one run wins a few times in a row it gallops to the end of its streak and copies all of it at once
+    template <typename RunIterator, typename OutputIterator, typename Comparison>
+    OutputIterator MergeK(RunIterator runs_first, RunIterator runs_last, OutputIterator output, Comparison compare) {
+        typedef typename std::iterator_traits<RunIterator>::value_type::first_type Iterator;
+        const std::size_t gallop_length = 7;
+
+        LoserTree<Iterator, Comparison> tree (compare);
+        for (RunIterator run = runs_first; run != runs_last; ++run) {
+            if (run->first == run->second) continue;
+            tree.next.push_back(run->first);
+            tree.end.push_back(run->second);
+        }
+        if (tree.next.empty()) return output;
+        tree.build();
+
+        const std::size_t none = std::numeric_limits<std::size_t>::max();
+        std::size_t previous = none, streak = 0;
+        while (tree.next.size() > 1) {
+            const std::size_t run = tree.losers[0];
+            Iterator & index = tree.next[run];
+
+            streak = (run == previous) ? streak + 1 : 1;
+            previous = run;
+            if (streak < gallop_length) {
+                *output = *index;
+                ++output;
+                ++index;
+            } else {
+                // every item in this run up to the next item from the runner-up
+                const std::size_t second = tree.runnerUp();
+                Iterator streak_end;
+                if (run < second) streak_end = GallopUpperBound(index, tree.end[run], *tree.next[second], compare);
+                else streak_end = GallopLowerBound(index, tree.end[run], *tree.next[second], compare);
+                output = std::copy(index, streak_end, output);
+                index = streak_end;
+                streak = 0;
+            }
+
+            if (index == tree.end[run]) {
+                tree.remove();
+                previous = none;
+            } else {
+                tree.replay();
+            }
+        }
+        return std::copy(tree.next[0], tree.end[0], output);
+    }
+
+    template <typename RunIterator, typename OutputIterator>
+    OutputIterator MergeK(RunIterator runs_first, RunIterator runs_last, OutputIterator output) {
+        typedef typename std::iterator_traits<RunIterator>::value_type::first_type Iterator;
+        return MergeK(runs_first, runs_last, output, std::less<typename std::iterator_traits<Iterator>::value_type>());
+    }
+
+    // stably merge the k adjacent sorted runs in [first, last), which start at 'first' and at each of [middles_first, middles_last),
+    // by merging neighboring pairs of runs with InplaceMerge until one is left. that's log2(k) passes over the array,
+    // but it's still O(1) memory, with [cache, cache_end) as scratch space for every merge
+    template <typename RandomAccessIterator, typename MiddleIterator, typename Comparison>
+    void InplaceMergeK(RandomAccessIterator first, MiddleIterator middles_first, MiddleIterator middles_last,
+                       RandomAccessIterator last, Comparison compare,
+                       typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                       typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end) {
+        std::vector<RandomAccessIterator> starts (1, first);
+        starts.insert(starts.end(), middles_first, middles_last);
+        starts.push_back(last);
+
+        while (starts.size() > 2) {
+            std::size_t merged = 0;
+            for (std::size_t run = 0; run + 1 < starts.size(); run += 2) {
+                if (run + 2 < starts.size()) InplaceMerge(starts[run], starts[run + 1], starts[run + 2], compare, cache, cache_end);
+                starts[merged++] = starts[run];
+            }
+            starts[merged++] = last;
+            starts.resize(merged);
+        }
+    }
+
+    template <typename RandomAccessIterator, typename MiddleIterator, typename Comparison>
+    void InplaceMergeK(RandomAccessIterator first, MiddleIterator middles_first, MiddleIterator middles_last,
+                       RandomAccessIterator last, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        alignas(T) char cache_memory[StackCache<T>::size * sizeof(T)];
+        T *cache = reinterpret_cast<T *>(cache_memory);
+        const std::size_t cache_size = std::min(sizeof(cache_memory)/sizeof(T), CacheItems<T>(L1CacheBytes()));
+        InplaceMergeK(first, middles_first, middles_last, last, compare, cache, cache + cache_size);
+    }
+
+    // execution policies for Sort, along the lines of std::execution::seq, par, and par_unseq
+    class SequencedPolicy {};
+
+    class ParallelPolicy {
+        std::size_t thread_count;
+
+    public:
+
+        // 0 threads means one thread per hardware thread
+        explicit ParallelPolicy(std::size_t thread_count = 0):
+            thread_count(thread_count)
+        {}
+
+        std::size_t threads() const {
+            if (thread_count > 0) return thread_count;
+            return std::max(std::thread::hardware_concurrency(), 1u);
+        }
+    };
+
+    // the merges are already as vectorized as the element type and comparison allow,
+    // so this is the same as the parallel policy
+    class ParallelUnsequencedPolicy : public ParallelPolicy {
+    public:
+
+        explicit ParallelUnsequencedPolicy(std::size_t thread_count = 0):
+            ParallelPolicy(thread_count)
+        {}
+    };
+
+    const SequencedPolicy seq = SequencedPolicy();
+    const ParallelPolicy par = ParallelPolicy();
+    const ParallelUnsequencedPolicy par_unseq = ParallelUnsequencedPolicy();
+
+    // the calling thread plus count - 1 worker threads, which are kept around between calls to run()
+    class ThreadPool {
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake, done;
+        std::function<void (std::size_t)> task;
+        std::size_t next, total, remaining, generation;
+        std::exception_ptr error;
+        bool stop;
+
+        // run tasks until there are none left to start (the mutex must be locked)
+        void drain(std::unique_lock<std::mutex> & lock) {
+            while (next < total) {
+                std::size_t index = next++;
+                lock.unlock();
+                try {
+                    task(index);
+                } catch (...) {
+                    lock.lock();
+                    if (!error) error = std::current_exception();
+                    lock.unlock();
+                }
+                lock.lock();
+                if (--remaining == 0) done.notify_all();
+            }
+        }
+
+        void work() {
+            std::size_t seen = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                while (!stop && generation == seen) wake.wait(lock);
+                if (stop) return;
+                seen = generation;
+                drain(lock);
+            }
+        }
+
+        ThreadPool(const ThreadPool &);
+        ThreadPool & operator=(const ThreadPool &);
+
+    public:
+
+        explicit ThreadPool(std::size_t count):
+            next(0), total(0), remaining(0), generation(0), stop(false)
+        {
+            for (std::size_t index = 1; index < count; ++index) {
+                threads.push_back(std::thread(&ThreadPool::work, this));
+            }
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_all();
+            for (std::size_t index = 0; index < threads.size(); ++index) {
+                threads[index].join();
+            }
+        }
+
+        std::size_t size() const {
+            return threads.size() + 1;
+        }
+
+        // call function(0) through function(count - 1) across the threads and wait for all of them to finish,
+        // then rethrow the first exception thrown by any of them
+        void run(std::size_t count, const std::function<void (std::size_t)> & function) {
+            std::unique_lock<std::mutex> lock(mutex);
+            task = function;
+            next = 0;
+            total = remaining = count;
+            error = std::exception_ptr();
+            ++generation;
+            wake.notify_all();
+
+            drain(lock);
+            while (remaining > 0) done.wait(lock);
+
+            if (error) std::rethrow_exception(error);
+        }
+    };
+
+    // split the ranges in this level into one contiguous section per thread, in multiples of 'unit' ranges,
+    // and call function(section, index) for each section in parallel
+    template <typename Function>
+    void ForEachSection(ThreadPool & pool, const Wiki::Iterator & iterator, std::size_t unit, Function function) {
+        const std::size_t units = iterator.count() / unit;
+        const std::size_t sections = std::min(pool.size(), units);
+
+        pool.run(sections, [&](std::size_t index) {
+            std::size_t start = units * index / sections;
+            std::size_t end = units * (index + 1) / sections;
+
+            Wiki::Iterator section (iterator);
+            section.select(start * unit, (end - start) * unit);
+            function(section, index);
+        });
+    }
+
+    // reverse the range with every thread swapping its own share of the items
+    template <typename RandomAccessIterator>
+    void Reverse(ThreadPool & pool, RandomAccessIterator first, RandomAccessIterator last) {
+        const std::size_t half = std::distance(first, last) / 2;
+        const std::size_t sections = std::min(pool.size(), half / 4096 + 1);
+
+        pool.run(sections, [&](std::size_t index) {
+            std::size_t start = half * index / sections;
+            std::size_t end = half * (index + 1) / sections;
+            std::swap_ranges(first + start, first + end, std::reverse_iterator<RandomAccessIterator>(last - start));
+        });
+    }
+
+    // rotate using three reversals, which unlike std::rotate can be split up between the threads
+    template <typename RandomAccessIterator>
+    void Rotate(ThreadPool & pool, RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last) {
+        if (first == middle || middle == last) return;
+        Reverse(pool, first, middle);
+        Reverse(pool, middle, last);
+        Reverse(pool, first, last);
+    }
+
+    // find how many of the first 'count' items in the merged output come from A
+    // (this is the "merge path" or co-ranking search, where equal items from A go before the ones from B)
+    template <typename RandomAccessIterator, typename Comparison>
+    std::size_t CoRank(Range<RandomAccessIterator> A, Range<RandomAccessIterator> B,
+                       std::size_t count, Comparison compare) {
+        std::size_t low = (count > B.length()) ? count - B.length() : 0;
+        std::size_t high = std::min(count, A.length());
+
+        while (low < high) {
+            std::size_t mid = low + (high - low) / 2;
+            if (!compare(B.start[count - mid - 1], A.start[mid])) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    // merge each A+B combination when there are fewer of them than there are threads,
+    // which happens for the last few levels of the merge sort.
+    // find where the middle of each merged output falls within A and B, then rotate the A values after
+    // that point past the B values before it, which splits it into two smaller merges that can be done separately.
+    // repeat until there are enough merges to go around, then merge each one with its own cache and internal buffers
+    // each thread uses its own 'cache_size' items from the cache, for as many of the merges as it is given
+    template <typename RandomAccessIterator, typename Comparison>
+    void MergeParallel(ThreadPool & pool, std::vector<Range<RandomAccessIterator> > & A,
+                       std::vector<Range<RandomAccessIterator> > & B,
+                       typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                       std::size_t cache_size, Comparison compare) {
+        while (A.size() < pool.size()) {
+            const std::size_t count = A.size();
+            std::vector<std::size_t> split (count), A_split (count);
+
+            pool.run(count, [&](std::size_t index) {
+                split[index] = (A[index].length() + B[index].length()) / 2;
+                A_split[index] = CoRank(A[index], B[index], split[index], compare);
+            });
+
+            A.resize(count * 2);
+            B.resize(count * 2);
+            for (std::size_t index = 0; index < count; ++index) {
+                RandomAccessIterator middle = A[index].start + split[index];
+                RandomAccessIterator B_split = B[index].start + (split[index] - A_split[index]);
+
+                Rotate(pool, A[index].start + A_split[index], A[index].end, B_split);
+
+                A[count + index] = Range<RandomAccessIterator>(middle, B_split);
+                B[count + index] = Range<RandomAccessIterator>(B_split, B[index].end);
+                A[index].end = A[index].start + A_split[index];
+                B[index] = Range<RandomAccessIterator>(A[index].end, middle);
+            }
+        }
+
+        pool.run(pool.size(), [&](std::size_t index) {
+            for (std::size_t merge = index; merge < A.size(); merge += pool.size()) {
+                MergeRange(A[merge].start, A[merge].end, B[merge].end,
+                           cache + index * cache_size, cache_size, compare);
+            }
+        });
+    }
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void Sort(const SequencedPolicy &, RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        Sort(first, last, compare);
+    }
+
+    // starting up threads isn't worth it unless each one has a decent amount of work to do
+    inline std::size_t ParallelThreads(const ParallelPolicy & policy, std::size_t size) {
+        return std::min(policy.threads(), size / 4096);
+    }
+
+    // the same merge sort, but the sorting networks and the A+B merges within each level are split up between threads
+    // each thread uses its own equal share of [cache, cache_end) and pulls its internal buffers out of its own
+    // section of the array, so the memory use is still O(1) per thread
+    template <typename RandomAccessIterator, typename Comparison>
+    void Sort(const ParallelPolicy & policy, RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+              typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+              typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end) {
+        const std::size_t size = std::distance(first, last);
+        const std::size_t threads = ParallelThreads(policy, size);
+        if (threads <= 1) {
+            Sort(first, last, compare, cache, cache_end);
+            return;
+        }
+
+        ThreadPool pool (threads);
+        const std::size_t cache_size = (cache_end - cache) / pool.size();
+        Wiki::Iterator iterator (size, 4);
+        ForEachSection(pool, iterator, 1, [&](Wiki::Iterator section, std::size_t) {
+            SortNetworks(first, section, compare);
+        });
+
+        while (true) {
+            bool merged_two_levels = false;
+
+            if (iterator.count() / 2 < pool.size()) {
+                // there aren't enough A+B combinations in this level to give each thread its own, so split them up
+                std::vector<Range<RandomAccessIterator> > A, B;
+                iterator.begin();
+                while (!iterator.finished()) {
+                    A.push_back(iterator.nextRange(first));
+                    B.push_back(iterator.nextRange(first));
+                }
+                MergeParallel(pool, A, B, cache, cache_size, compare);
+            } else {
+                // the four-subarray cache merge works on two A+B combinations at a time, so keep them in the same section
+                ForEachSection(pool, iterator, std::min(iterator.count(), (std::size_t)4),
+                               [&](Wiki::Iterator section, std::size_t index) {
+                    bool merged = MergeLevel(first, section, cache + index * cache_size, cache_size, compare);
+                    if (index == 0) merged_two_levels = merged;
+                });
+            }
+            if (merged_two_levels) iterator.nextLevel();
+
+            if (!iterator.nextLevel()) break;
+        }
+    }
+
+    // give each thread a cache that fits into half of its L2 cache, but no larger than its share of the array
+    // (or no cache at all, if that memory isn't available)
+    template <typename RandomAccessIterator, typename Comparison>
+    void Sort(const ParallelPolicy & policy, RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        const std::size_t size = std::distance(first, last);
+        const std::size_t threads = ParallelThreads(policy, size);
+        if (threads <= 1) {
+            Sort(first, last, compare);
+            return;
+        }
+
+        std::size_t cache_size = threads * std::min(CacheItems<T>(L2CacheBytes()/2), size/threads);
+        std::unique_ptr<T, void (*)(void *)> cache (AllocateCache<T>(cache_size), FreeCache);
+        if (!cache) cache_size = 0;
+        Sort(ParallelPolicy(threads), first, last, compare, cache.get(), cache.get() + cache_size);
+    }
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void Sort(const SequencedPolicy &, RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+              typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+              typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end) {
+        Sort(first, last, compare, cache, cache_end);
+    }
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void InplaceMerge(const SequencedPolicy &, RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last,
+                      Comparison compare) {
+        InplaceMerge(first, middle, last, compare);
+    }
+
+    // split the merge into one per thread at the co-ranks of the merged output, as in the last levels of the parallel sort
+    template <typename RandomAccessIterator, typename Comparison>
+    void InplaceMerge(const ParallelPolicy & policy, RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last,
+                      Comparison compare,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end) {
+        const std::size_t threads = ParallelThreads(policy, std::distance(first, last));
+        if (threads <= 1) {
+            InplaceMerge(first, middle, last, compare, cache, cache_end);
+            return;
+        }
+        if (first == middle || middle == last) return;
+
+        ThreadPool pool (threads);
+        std::vector<Range<RandomAccessIterator> > A (1, Range<RandomAccessIterator>(first, middle));
+        std::vector<Range<RandomAccessIterator> > B (1, Range<RandomAccessIterator>(middle, last));
+        MergeParallel(pool, A, B, cache, (cache_end - cache) / pool.size(), compare);
+    }
+
+    // each thread gets the same cache it would have in the parallel Sort (or none, if that memory isn't available)
+    template <typename RandomAccessIterator, typename Comparison>
+    void InplaceMerge(const ParallelPolicy & policy, RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last,
+                      Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        const std::size_t size = std::distance(first, last);
+        const std::size_t threads = ParallelThreads(policy, size);
+        if (threads <= 1) {
+            InplaceMerge(first, middle, last, compare);
+            return;
+        }
+
+        std::size_t cache_size = threads * std::min(CacheItems<T>(L2CacheBytes()/2), size/threads);
+        std::unique_ptr<T, void (*)(void *)> cache (AllocateCache<T>(cache_size), FreeCache);
+        if (!cache) cache_size = 0;
+        InplaceMerge(ParallelPolicy(threads), first, middle, last, compare, cache.get(), cache.get() + cache_size);
+    }
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void InplaceMerge(const SequencedPolicy &, RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last,
+                      Comparison compare,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                      typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end) {
+        InplaceMerge(first, middle, last, compare, cache, cache_end);
+    }
+
+    // merge the sorted candidates in [first2, last2) into the sorted window [first1, last1), keeping the window's size
+    // the window keeps the smallest items, while the ones it no longer needs are swapped into [first2, last2) in no particular order
+    // (the window's items were all before the candidates, so they stay before any of them that are equal)
+    template <typename RandomAccessIterator, typename Comparison>
+    void MergeSmallest(RandomAccessIterator first1, RandomAccessIterator last1,
+                       RandomAccessIterator first2, RandomAccessIterator last2, Comparison compare,
+                       typename std::iterator_traits<RandomAccessIterator>::value_type *cache,
+                       typename std::iterator_traits<RandomAccessIterator>::value_type *cache_end) {
+        const std::size_t size = last1 - first1;
+        const std::size_t kept = CoRank(Range<RandomAccessIterator>(first1, last1), Range<RandomAccessIterator>(first2, last2),
+                                        size, compare);
+        std::swap_ranges(first1 + kept, last1, first2);
+        InplaceMerge(first1, first1 + kept, last1, compare, cache, cache_end);
+    }
+
+    // stably sort the smallest (middle - first) items into [first, middle), like a stable std::partial_sort,
+    // leaving the rest of the items in [middle, last) in no particular order.
+    // the rest of the array is scanned (middle - first) items at a time, and only the items in each of those sections
+    // that would make it into the window are moved to its front, then sorted and merged in. that's O(n log k) at worst,
+    // but once the window holds small enough items most sections don't have any, and it's closer to O(n)
+    // every sort and merge shares the same cache on the stack, so this never allocates
+    template <typename RandomAccessIterator, typename Comparison>
+    void PartialSort(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        if (first == middle) return;
+
+        alignas(T) char cache_memory[StackCache<T>::size * sizeof(T)];
+        T *cache = reinterpret_cast<T *>(cache_memory);
+        T *cache_end = cache + std::min(sizeof(cache_memory)/sizeof(T), CacheItems<T>(L1CacheBytes()));
+        Sort(first, middle, compare, cache, cache_end);
+
+        const std::size_t size = middle - first;
+        for (RandomAccessIterator section = middle; section != last;) {
+            RandomAccessIterator section_end = section + std::min(size, (std::size_t)(last - section));
+
+            // move the candidates to the front of the section, in the same order they were in
+            RandomAccessIterator candidates = section;
+            for (RandomAccessIterator index = section; index != section_end; ++index) {
+                if (compare(*index, *(middle - 1))) {
+                    if (index != candidates) std::iter_swap(index, candidates);
+                    ++candidates;
+                }
+            }
+
+            if (candidates != section) {
+                Sort(section, candidates, compare, cache, cache_end);
+                MergeSmallest(first, middle, section, candidates, compare, cache, cache_end);
+            }
+            section = section_end;
+        }
+    }
+
+    // stably move the items that satisfy pred to the front, like std::stable_partition, and return the end of those items
+    // each section is partitioned by moving the items that don't satisfy pred out into the stack cache, and it keeps going
+    // until the cache is full, so when nearly every item satisfies pred there are only a few long sections to merge.
+    // then neighboring sections are merged by rotating the items from the second one that do satisfy pred past the ones
+    // from the first that don't. sections are merged in pairs of equal sizes like a binary counter, so pred is only called
+    // once per item, each item is only rotated O(log(n/cache)) times, and this never allocates
+    template <typename RandomAccessIterator, typename Predicate>
+    RandomAccessIterator StablePartition(RandomAccessIterator first, RandomAccessIterator last, Predicate pred) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        // the items at the start that already satisfy pred don't need to go anywhere
+        while (first != last && pred(*first)) ++first;
+        if (first == last) return first;
+
+        alignas(T) char cache_memory[StackCache<T>::size * sizeof(T)];
+        T *cache = reinterpret_cast<T *>(cache_memory);
+        const std::size_t cache_size = std::min(sizeof(cache_memory)/sizeof(T), CacheItems<T>(L1CacheBytes()));
+
+        // each section on the stack is partitioned into [start, split) and [split, the next section's start),
+        // and it holds more sections than the one above it, so the stack never holds more than there are bits in a size_t
+        struct {
+            RandomAccessIterator start, split;
+            std::size_t sections;
+        } stack[sizeof(std::size_t) * 8 + 1];
+        std::size_t stack_size = 0;
+
+        for (RandomAccessIterator start = first; start != last;) {
+            RandomAccessIterator split = start, end = start;
+            T *cache_end = cache;
+            for (; end != last; ++end) {
+                if (pred(*end)) {
+                    // moving an item onto itself can leave it empty, like std::string does
+                    if (split != end) *split = std::move(*end);
+                    ++split;
+                } else {
+                    if (cache_end == cache + cache_size) break;
+                    ::new((void *)cache_end) T(std::move(*end));
+                    ++cache_end;
+                }
+            }
+            std::move(cache, cache_end, split);
+            DestroyCache(cache, cache_end);
+
+            // also merge right away whenever the earlier items that failed pred are no more than the items
+            // from this section that passed it, since those have to be moved past them at some point anyway
+            std::size_t sections = 1;
+            while (stack_size > 0 && (stack[stack_size - 1].sections <= sections || start - stack[stack_size - 1].split <= split - start)) {
+                --stack_size;
+                // there's nothing to rotate when the earlier sections had no items that failed pred,
+                // or when this one had no items that passed it
+                if (stack[stack_size].split != start && start != split)
+                    Rotate(stack[stack_size].split, start, split, cache, cache_size);
+                split = stack[stack_size].split + (split - start);
+                start = stack[stack_size].start;
+                sections += stack[stack_size].sections;
+            }
+
+            stack[stack_size].start = start;
+            stack[stack_size].split = split;
+            stack[stack_size].sections = sections;
+            ++stack_size;
+            start = end;
+        }
+
+        RandomAccessIterator start = stack[stack_size - 1].start, split = stack[stack_size - 1].split;
+        for (--stack_size; stack_size > 0;) {
+            --stack_size;
+            if (stack[stack_size].split != start && start != split)
+                Rotate(stack[stack_size].split, start, split, cache, cache_size);
+            split = stack[stack_size].split + (split - start);
+            start = stack[stack_size].start;
+        }
+        return split;
+    }
+
+    // keep the smallest k items out of everything pushed into it, in stable sorted order, using O(k) memory
+    // items are dropped right away if they can't make it into the window, and the rest are collected into batches of k,
+    // which are sorted and merged into the window whenever a batch fills up (or when sorted() is called)
+    template <typename T, typename Comparison = std::less<T> >
+    class TopK {
+    public:
+        std::vector<T> items;
+        std::size_t k, window;
+        Comparison compare;
+
+        TopK(std::size_t k, Comparison compare = Comparison()) : k(k), window(0), compare(compare) {
+            items.reserve(k * 2);
+        }
+
+        void push(const T & item) {
+            if (k == 0 || (window == k && !compare(item, items[window - 1]))) return;
+            items.push_back(item);
+            if (items.size() - window >= k) flush();
+        }
+
+        void push(T && item) {
+            if (k == 0 || (window == k && !compare(item, items[window - 1]))) return;
+            items.push_back(std::move(item));
+            if (items.size() - window >= k) flush();
+        }
+
+        template <typename Iterator>
+        void push(Iterator first, Iterator last) {
+            for (; first != last; ++first) push(*first);
+        }
+
+        // merge the current batch into the window
+        void flush() {
+            if (items.size() == window) return;
+            Sort(items.begin() + window, items.end(), compare);
+            InplaceMerge(items.begin(), items.begin() + window, items.end(), compare);
+            window = std::min(k, items.size());
+            items.erase(items.begin() + window, items.end());
+        }
+
+        // the smallest k items so far, in sorted order
+        const std::vector<T> & sorted() {
+            flush();
+            return items;
+        }
+    };
+
+    // an item's key, along with where the item was in the array
+    template <typename Key>
+    class KeyIndex {
+    public:
+        Key key;
+        std::size_t index;
+    };
+
+    template <typename Key, typename KeyComparison>
+    class KeyIndexCompare {
+    public:
+        KeyComparison compare;
+        KeyIndexCompare(KeyComparison compare) : compare(compare) {}
+
+        bool operator()(const KeyIndex<Key> & item1, const KeyIndex<Key> & item2) {
+            return compare(item1.key, item2.key);
+        }
+    };
+
+    // sort the items by key(item), for when finding the key is what makes each comparison expensive
+    // each key is found once rather than O(n log n) times, then the (key, index) pairs are sorted and the items
+    // are moved to where their indices ended up. this uses O(n) memory for the pairs (and half as many again
+    // as a cache while sorting them, if it's available)
+    template <typename RandomAccessIterator, typename KeyFunction, typename KeyComparison>
+    void SortBy(RandomAccessIterator first, RandomAccessIterator last, KeyFunction key, KeyComparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        typedef typename std::decay<decltype(key(*first))>::type Key;
+        const std::size_t size = std::distance(first, last);
+        if (size < 2) return;
+
+        std::vector<KeyIndex<Key> > keys (size);
+        for (std::size_t index = 0; index < size; index++) {
+            keys[index].key = key(first[index]);
+            keys[index].index = index;
+        }
+
+        Cache<KeyIndex<Key> > cache (size);
+        Sort(keys.begin(), keys.end(), KeyIndexCompare<Key, KeyComparison>(compare), cache.cache, cache.cache + cache.cache_size);
+
+        // keys[index].index is the item that belongs at index, so follow each cycle of that permutation
+        // and mark each index as finished by pointing it at itself
+        for (std::size_t start = 0; start < size; start++) {
+            if (keys[start].index == start) continue;
+
+            T item = std::move(first[start]);
+            std::size_t index = start;
+            while (keys[index].index != start) {
+                std::size_t from = keys[index].index;
+                first[index] = std::move(first[from]);
+                keys[index].index = index;
+                index = from;
+            }
+            first[index] = std::move(item);
+            keys[index].index = index;
+        }
+    }
+
+    template <typename RandomAccessIterator, typename KeyFunction>
+    void SortBy(RandomAccessIterator first, RandomAccessIterator last, KeyFunction key) {
+        typedef typename std::decay<decltype(key(*first))>::type Key;
+        SortBy(first, last, key, std::less<Key>());
+    }
+
+#if WIKI_MMAP
+    // how to find and compare the key within each fixed-size record of a file
+    class FileSortOptions {
+    public:
+        enum KeyType { Bytes, Unsigned, Signed, Float };
+
+        std::size_t record_size, key_offset, key_width;
+        KeyType key_type;
+        bool big_endian;
+
+        FileSortOptions() : record_size(0), key_offset(0), key_width(0), key_type(Bytes), big_endian(false) {}
+    };
+
+    template <std::size_t Size>
+    class Record {
+    public:
+        unsigned char bytes[Size];
+    };
+
+    // byte keys are compared with memcmp, and numeric keys are loaded into a uint64_t
+    // that's ordered the same way the numbers are (like the radix sort's keys, with -0.0 equal to +0.0)
+    class RecordKey {
+    public:
+        FileSortOptions options;
+        uint64_t sign;
+
+        RecordKey(const FileSortOptions & options) :
+            options(options),
+            sign(options.key_width <= 8 ? (uint64_t)1 << (options.key_width * 8 - 1) : 0)
+        {}
+
+        uint64_t load(const unsigned char *bytes) const {
+            uint64_t value = 0;
+            if (options.big_endian) {
+                for (std::size_t index = 0; index < options.key_width; index++)
+                    value = (value << 8) | bytes[index];
+            } else {
+                for (std::size_t index = options.key_width; index > 0; index--)
+                    value = (value << 8) | bytes[index - 1];
+            }
+            return value;
+        }
+
+        uint64_t value(const unsigned char *record) const {
+            uint64_t value = load(record + options.key_offset);
+            if (options.key_type == FileSortOptions::Signed) return value ^ sign;
+            if (options.key_type == FileSortOptions::Float) {
+                if ((value & ~sign) == 0) return sign;
+                if (value & sign) return ~value & (sign | (sign - 1));
+                return value | sign;
+            }
+            return value;
+        }
+
+        bool less(const unsigned char *record1, const unsigned char *record2) const {
+            if (options.key_type == FileSortOptions::Bytes)
+                return std::memcmp(record1 + options.key_offset, record2 + options.key_offset, options.key_width) < 0;
+            return value(record1) < value(record2);
+        }
+    };
+
+    template <std::size_t Size>
+    class RecordCompare {
+    public:
+        RecordKey key;
+        RecordCompare(const RecordKey & key) : key(key) {}
+
+        bool operator()(const Record<Size> & record1, const Record<Size> & record2) const {
+            return key.less(record1.bytes, record2.bytes);
+        }
+    };
+
+    // madvise needs the address to be aligned to a page
+    inline void AdviseRange(const void *address, std::size_t length, int advice) {
+        static const std::size_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)address & ~(uintptr_t)(page - 1);
+        madvise((void *)start, (uintptr_t)address + length - start, advice);
+    }
+
+    // Sort walks the whole array once per level, which means reading the whole file once per level when it doesn't fit
+    // into memory. so sort sections small enough to stay in memory first, then merge pairs of sections level by level
+    // with InplaceMerge, which only takes log2(file / section) more passes over the file.
+    // each level sweeps through the file from start to end, and the pages each merge needs are requested right before it
+    template <std::size_t Size>
+    void SortRecords(Record<Size> *records, std::size_t count, RecordCompare<Size> compare) {
+        const std::size_t section = std::max((std::size_t)(64 << 20) / Size, (std::size_t)1);
+        AdviseRange(records, count * Size, MADV_SEQUENTIAL);
+
+        for (std::size_t start = 0; start < count; start += section) {
+            std::size_t end = std::min(start + section, count);
+            AdviseRange(records + start, (end - start) * Size, MADV_WILLNEED);
+            Sort(records + start, records + end, compare);
+        }
+
+        for (std::size_t length = section; length < count; length *= 2) {
+            for (std::size_t start = 0; start + length < count; start += length * 2) {
+                std::size_t end = std::min(start + length * 2, count);
+                AdviseRange(records + start, (end - start) * Size, MADV_WILLNEED);
+                InplaceMerge(records + start, records + start + length, records + end, compare);
+            }
+        }
+    }
+
+    // the record sizes SortFile supports, since each one is a separate instantiation of the sort
+    #define WIKI_RECORD_SIZES(RECORD_SIZE) \
+        RECORD_SIZE(1) RECORD_SIZE(2) RECORD_SIZE(4) RECORD_SIZE(8) RECORD_SIZE(12) RECORD_SIZE(16) \
+        RECORD_SIZE(20) RECORD_SIZE(24) RECORD_SIZE(32) RECORD_SIZE(48) RECORD_SIZE(64) RECORD_SIZE(100) \
+        RECORD_SIZE(128) RECORD_SIZE(256) RECORD_SIZE(512) RECORD_SIZE(1024)
+
+    // throws std::runtime_error if the record size isn't supported or the key doesn't make sense for it
+    // (checked without adding the key's offset and width, which could wrap around)
+    inline void ValidateOptions(const FileSortOptions & options) {
+        #define WIKI_SUPPORTED_SIZE(size) case size:
+        switch (options.record_size) {
+            WIKI_RECORD_SIZES(WIKI_SUPPORTED_SIZE) break;
+            default: throw std::runtime_error("unsupported record size");
+        }
+        #undef WIKI_SUPPORTED_SIZE
+
+        if (options.key_width == 0 || options.key_offset >= options.record_size ||
+            options.key_width > options.record_size - options.key_offset)
+            throw std::runtime_error("the key has to fit within the record");
+        if (options.key_type != FileSortOptions::Bytes && options.key_width > 8)
+            throw std::runtime_error("numeric keys can be at most 8 bytes wide");
+        if (options.key_type == FileSortOptions::Float && options.key_width != 4 && options.key_width != 8)
+            throw std::runtime_error("floating-point keys have to be 4 or 8 bytes wide");
+    }
+
+    // sort a file of fixed-size records in place, by memory-mapping it rather than reading it in,
+    // so the only memory used besides the file's own pages is Sort's usual O(1) cache
+    // throws std::runtime_error if the options don't make sense for the file, or the file couldn't be mapped
+    inline void SortFile(const char *path, const FileSortOptions & options) {
+        ValidateOptions(options);
+
+        int file = open(path, O_RDWR);
+        if (file < 0) throw std::runtime_error(std::string("couldn't open ") + path + ": " + std::strerror(errno));
+
+        struct stat info;
+        if (fstat(file, &info) != 0) {
+            close(file);
+            throw std::runtime_error(std::string("couldn't read the size of ") + path);
+        }
+        const std::size_t size = info.st_size;
+        if (size % options.record_size != 0) {
+            close(file);
+            throw std::runtime_error("the file size isn't a multiple of the record size");
+        }
+        if (size == 0) {
+            close(file);
+            return;
+        }
+
+        void *data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        close(file);
+        if (data == MAP_FAILED) throw std::runtime_error(std::string("couldn't map ") + path + ": " + std::strerror(errno));
+
+        const std::size_t count = size / options.record_size;
+        const RecordKey key (options);
+        try {
+            #define WIKI_SORT_RECORDS(size) \
+                case size: SortRecords((Record<size> *)data, count, RecordCompare<size>(key)); break;
+            switch (options.record_size) {
+                WIKI_RECORD_SIZES(WIKI_SORT_RECORDS)
+            }
+            #undef WIKI_SORT_RECORDS
+        } catch (...) {
+            munmap(data, size);
+            throw;
+        }
+        munmap(data, size);
+    }
+
+    // a file descriptor that's closed when it goes out of scope
+    class FileDescriptor {
+        FileDescriptor(const FileDescriptor &);
+        FileDescriptor & operator=(const FileDescriptor &);
+
+    public:
+        int file;
+        explicit FileDescriptor(int file) : file(file) {}
+        ~FileDescriptor() { if (file >= 0) close(file); }
+    };
+
+    // read or write all of [buffer, buffer + length) at 'offset' in the file, unless the file ends first
+    // returns how many bytes were read or written, and throws if the file couldn't be accessed
+    inline std::size_t ReadFully(int file, void *buffer, std::size_t length, uint64_t offset) {
+        std::size_t total = 0;
+        while (total < length) {
+            ssize_t amount = pread(file, (char *)buffer + total, length - total, offset + total);
+            if (amount < 0 && errno == EINTR) continue;
+            if (amount < 0) throw std::runtime_error(std::string("couldn't read: ") + std::strerror(errno));
+            if (amount == 0) break;
+            total += amount;
+        }
+        return total;
+    }
+
+    inline void WriteFully(int file, const void *buffer, std::size_t length, uint64_t offset) {
+        std::size_t total = 0;
+        while (total < length) {
+            ssize_t amount = pwrite(file, (const char *)buffer + total, length - total, offset + total);
+            if (amount < 0 && errno == EINTR) continue;
+            if (amount <= 0) throw std::runtime_error(std::string("couldn't write: ") + std::strerror(errno));
+            total += amount;
+        }
+    }
+
+    // a read that can run in the background while the caller works on something else
+    class ReadRequest {
+    public:
+        int file;
+        void *buffer;
+        std::size_t length, result;
+        uint64_t offset;
+        bool done;
+        std::exception_ptr error;
+
+        ReadRequest() : file(-1), buffer(0), length(0), result(0), offset(0), done(true) {}
+    };
+
+    // performs reads in order on a background thread, or right away if that thread couldn't be started
+    class Reader {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake, finished;
+        std::deque<ReadRequest *> queue;
+        bool stop;
+
+        static void perform(ReadRequest & request) {
+            try {
+                request.result = ReadFully(request.file, request.buffer, request.length, request.offset);
+            } catch (...) {
+                request.error = std::current_exception();
+            }
+        }
+
+        void work() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                while (!stop && queue.empty()) wake.wait(lock);
+                if (stop) return;
+
+                ReadRequest *request = queue.front();
+                queue.pop_front();
+                lock.unlock();
+                perform(*request);
+                lock.lock();
+                request->done = true;
+                finished.notify_all();
+            }
+        }
+
+        Reader(const Reader &);
+        Reader & operator=(const Reader &);
+
+    public:
+        bool asynchronous;
+
+        explicit Reader(bool asynchronous) : stop(false), asynchronous(asynchronous) {
+            if (!asynchronous) return;
+            try {
+                thread = std::thread(&Reader::work, this);
+            } catch (const std::system_error &) {
+                this->asynchronous = false;
+            }
+        }
+
+        ~Reader() {
+            if (!asynchronous) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_all();
+            thread.join();
+        }
+
+        void submit(ReadRequest & request) {
+            request.done = false;
+            request.error = std::exception_ptr();
+            if (!asynchronous) {
+                perform(request);
+                request.done = true;
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(&request);
+            wake.notify_one();
+        }
+
+        // wait for the read to finish, then rethrow whatever it threw
+        std::size_t wait(ReadRequest & request) {
+            if (asynchronous) {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!request.done) finished.wait(lock);
+            }
+            if (request.error) std::rethrow_exception(request.error);
+            return request.result;
+        }
+    };
+
+    // how long each phase of ExternalSortFile took, for working out its throughput
+    class ExternalSortStats {
+    public:
+        uint64_t bytes;
+        std::size_t runs;
+        double run_seconds, merge_seconds;
+
+        ExternalSortStats() : bytes(0), runs(0), run_seconds(0), merge_seconds(0) {}
+    };
+
+    // one sorted run in the temporary file, which is read back two blocks at a time:
+    // the records in one block are merged while the next block is being read into the other one
+    template <std::size_t Size>
+    class RunReader {
+        RunReader(const RunReader &);
+        RunReader & operator=(const RunReader &);
+
+    public:
+        std::vector<Record<Size> > blocks[2];
+        ReadRequest requests[2];
+        uint64_t offset, end;
+        std::size_t current, index, count;
+
+        RunReader() : offset(0), end(0), current(0), index(0), count(0) {}
+
+        void request(Reader & reader, int file, std::size_t block) {
+            std::size_t length = std::min((uint64_t)blocks[block].size() * Size, end - offset);
+            requests[block].length = length;
+            if (length == 0) return;
+            requests[block].file = file;
+            requests[block].buffer = &blocks[block][0];
+            requests[block].offset = offset;
+            offset += length;
+            reader.submit(requests[block]);
+        }
 
-            // 512 – chosen from careful testing as a good balance between fixed-size memory use and run time
-            if (cache_size > 512) {
-                cache_size = 512;
-                cache = new (std::nothrow) T[cache_size];
-                if (cache) return;
+        void start(Reader & reader, int file, uint64_t start, uint64_t finish, std::size_t block_size) {
+            offset = start;
+            end = finish;
+            blocks[0].resize(block_size);
+            blocks[1].resize(block_size);
+            request(reader, file, 0);
+            current = 0;
+            index = 0;
+            count = reader.wait(requests[0]) / Size;
+            request(reader, file, 1);
+        }
+
+        // switch to the other block once this one has been merged, and start reading the one after that into this one
+        // returns false once the run has been read all the way through
+        bool next(Reader & reader, int file) {
+            current = 1 - current;
+            index = 0;
+            count = (requests[current].length > 0) ? reader.wait(requests[current]) / Size : 0;
+            if (count > 0) request(reader, file, 1 - current);
+            return count > 0;
+        }
+
+        const Record<Size> & front() const {
+            return blocks[current][index];
+        }
+    };
+
+    // orders the runs in the k-way merge's heap by their next records, and by their index when those are equal,
+    // so that equal records come out in the order their runs were read in (std::push_heap puts the largest on top)
+    template <std::size_t Size>
+    class RunCompare {
+    public:
+        const std::vector<RunReader<Size> *> & runs;
+        RecordCompare<Size> compare;
+
+        RunCompare(const std::vector<RunReader<Size> *> & runs, RecordCompare<Size> compare) : runs(runs), compare(compare) {}
+
+        bool operator()(std::size_t run1, std::size_t run2) const {
+            if (compare(runs[run2]->front(), runs[run1]->front())) return true;
+            if (compare(runs[run1]->front(), runs[run2]->front())) return false;
+            return run1 > run2;
+        }
+    };
+
+    template <std::size_t Size>
+    void ExternalSortRecords(int input, int output, uint64_t size, std::size_t memory, const char *temp_directory,
+                             RecordCompare<Size> compare, bool asynchronous, ExternalSortStats & stats) {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+
+        // two thirds of the memory go to the records in each run, and the rest to the cache for sorting them
+        const uint64_t count = size / Size;
+        const std::size_t run_size = std::max(memory / 3 * 2 / Size, (std::size_t)1);
+        std::vector<Record<Size> > records (std::min((uint64_t)run_size, count));
+
+        std::size_t cache_size = std::max(memory / 3 / Size, (std::size_t)1);
+        std::unique_ptr<Record<Size>, void (*)(void *)> cache (AllocateCache<Record<Size> >(cache_size), FreeCache);
+        if (!cache) cache_size = 0;
+
+        // if it all fits into memory, there's nothing to merge
+        if (count <= run_size) {
+            ReadFully(input, &records[0], count * Size, 0);
+            Sort(records.begin(), records.end(), compare, cache.get(), cache.get() + cache_size);
+            WriteFully(output, &records[0], count * Size, 0);
+            stats.runs = 1;
+            stats.run_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            return;
+        }
+
+        // the runs all go into one temporary file, which is removed as soon as it's opened so nothing is left behind
+        std::string temp_path = std::string(temp_directory) + "/wikisort-XXXXXX";
+        std::vector<char> temp_name (temp_path.begin(), temp_path.end());
+        temp_name.push_back('\0');
+        FileDescriptor temp (mkstemp(&temp_name[0]));
+        if (temp.file < 0) throw std::runtime_error(std::string("couldn't create a temporary file in ") + temp_directory + ": " + std::strerror(errno));
+        unlink(&temp_name[0]);
+
+        std::vector<uint64_t> run_starts;
+        for (uint64_t offset = 0; offset < count * Size; offset += records.size() * Size) {
+            std::size_t length = std::min((uint64_t)records.size() * Size, count * Size - offset);
+            ReadFully(input, &records[0], length, offset);
+            Sort(records.begin(), records.begin() + length / Size, compare, cache.get(), cache.get() + cache_size);
+            WriteFully(temp.file, &records[0], length, offset);
+            run_starts.push_back(offset);
+        }
+        run_starts.push_back(count * Size);
+        records = std::vector<Record<Size> >();
+        cache.reset();
+
+        Clock::time_point merge_start = Clock::now();
+        stats.runs = run_starts.size() - 1;
+        stats.run_seconds = std::chrono::duration<double>(merge_start - start).count();
+
+        // then merge all of the runs at once, with the memory split between two blocks per run and the output
+        const std::size_t block_size = std::max(memory / (2 * stats.runs + 1) / Size, (std::size_t)1);
+        // (the reader is declared after the blocks it reads into, so its thread is stopped before they're freed)
+        std::vector<RunReader<Size> > run_readers (stats.runs);
+        std::vector<RunReader<Size> *> runs (stats.runs);
+        Reader reader (asynchronous);
+        std::vector<std::size_t> heap;
+        RunCompare<Size> run_compare (runs, compare);
+
+        for (std::size_t run = 0; run < stats.runs; run++) {
+            runs[run] = &run_readers[run];
+            runs[run]->start(reader, temp.file, run_starts[run], run_starts[run + 1], block_size);
+            heap.push_back(run);
+        }
+        std::make_heap(heap.begin(), heap.end(), run_compare);
+
+        std::vector<Record<Size> > out (block_size);
+        std::size_t out_count = 0;
+        uint64_t out_offset = 0;
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), run_compare);
+            RunReader<Size> & run = *runs[heap.back()];
+            out[out_count++] = run.front();
+            if (out_count == out.size()) {
+                WriteFully(output, &out[0], out_count * Size, out_offset);
+                out_offset += out_count * Size;
+                out_count = 0;
             }
 
-            // 0 – if the system simply cannot allocate any extra memory whatsoever, no memory works just fine
-            cache_size = 0;
+            if (++run.index < run.count || run.next(reader, temp.file)) {
+                std::push_heap(heap.begin(), heap.end(), run_compare);
+            } else {
+                heap.pop_back();
+            }
+        }
+        WriteFully(output, &out[0], out_count * Size, out_offset);
+
+        stats.merge_seconds = std::chrono::duration<double>(Clock::now() - merge_start).count();
+    }
+
+    // sort a file of fixed-size records that might not fit into memory into a separate output file.
+    // the input is read in runs that each fill two thirds of 'memory' bytes, which are sorted with the rest of it as a cache
+    // and written to a temporary file in 'temp_directory', then all of the runs are merged at once into the output.
+    // each run is read back in two blocks, and with 'asynchronous' the next block is read on another thread
+    // while the current one is being merged (and if that thread can't be started, the reads just happen in between)
+    // this needs as much temporary space as the input, and throws std::runtime_error if anything goes wrong
+    inline ExternalSortStats ExternalSortFile(const char *input_path, const char *output_path, const FileSortOptions & options,
+                                              std::size_t memory, const char *temp_directory, bool asynchronous = true) {
+        ValidateOptions(options);
+
+        FileDescriptor input (open(input_path, O_RDONLY));
+        if (input.file < 0) throw std::runtime_error(std::string("couldn't open ") + input_path + ": " + std::strerror(errno));
+
+        struct stat info;
+        if (fstat(input.file, &info) != 0) throw std::runtime_error(std::string("couldn't read the size of ") + input_path);
+        if (info.st_size % options.record_size != 0)
+            throw std::runtime_error("the file size isn't a multiple of the record size");
+
+        // the runs are read back from the input while the output is written, so they can't be the same file
+        // (and nothing is truncated until everything else has been checked)
+        struct stat output_info;
+        if (stat(output_path, &output_info) == 0 && output_info.st_dev == info.st_dev && output_info.st_ino == info.st_ino)
+            throw std::runtime_error("the output can't be the same file as the input");
+
+        FileDescriptor output (open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (output.file < 0) throw std::runtime_error(std::string("couldn't create ") + output_path + ": " + std::strerror(errno));
+
+        ExternalSortStats stats;
+        stats.bytes = info.st_size;
+        if (stats.bytes == 0) return stats;
+
+        const RecordKey key (options);
+        #define WIKI_EXTERNAL_SORT_RECORDS(size) \
+            case size: ExternalSortRecords(input.file, output.file, stats.bytes, memory, temp_directory, \
+                                           RecordCompare<size>(key), asynchronous, stats); break;
+        switch (options.record_size) {
+            WIKI_RECORD_SIZES(WIKI_EXTERNAL_SORT_RECORDS)
+            default: throw std::runtime_error("unsupported record size");
+        }
+        #undef WIKI_EXTERNAL_SORT_RECORDS
+
+        return stats;
+    }
+#endif
+}
+
+
+
+
+// class to test stable sorting (index will contain its original index in the array, to make sure it doesn't switch places with other items)
+class Test {
+public:
+    std::size_t value;
+#if VERIFY
+    std::size_t index;
+#endif
+#if TEST_STRINGS
+    std::string payload;
+#endif
+};
+
+// some fake overhead for comparisons, for SLOW_COMPARISONS and the benchmark's slow comparison
+// (in real-world use this might be string comparisons, etc.)
+#define NOOP_SIZE 50
+std::size_t noop1[NOOP_SIZE], noop2[NOOP_SIZE];
+
+bool TestCompare(const Test & item1, const Test & item2) {
+    #if SLOW_COMPARISONS
+        for (std::size_t index = 0; index < NOOP_SIZE; index++)
+            noop1[index] = noop2[index];
+    #endif
+
+    return item1.value < item2.value;
+}
+
+// the key TestCompare compares, with the same overhead for finding it
+std::size_t TestKey(const Test & item) {
+    #if SLOW_COMPARISONS
+        for (std::size_t index = 0; index < NOOP_SIZE; index++)
+            noop1[index] = noop2[index];
+    #endif
+
+    return item.value;
+}
+
+// a predicate to test partitioning with
+bool TestOdd(const Test & item) {
+    return item.value % 2 == 1;
+}
+
+// Test items compared by value can be radix sorted too, by specializing Wiki::RadixKey
+struct TestLess {
+    bool operator()(const Test & item1, const Test & item2) const {
+        return item1.value < item2.value;
+    }
+};
+
+namespace Wiki {
+    template <>
+    struct RadixKey<Test, TestLess> {
+        static const bool value = true;
+        typedef std::size_t Bits;
+
+        static Bits bits(const Test & item) {
+            return item.value;
         }
     };
+}
+
+using namespace std;
+
+// make sure the items within the given range are in a stable order
+// if you want to test the correctness of any changes you make to the main WikiSort function,
+// move this function to the top of the file and call it from within WikiSort after each step
+#if VERIFY
+template <typename Iterator, typename Comparison>
+void Verify(Iterator start, Iterator end, const Comparison compare, const string msg) {
+    for (Iterator it = start + 1; it < end ; ++it) {
+        // if it's in ascending order then we're good
+        // if both values are equal, we need to make sure the index values are ascending
+        if (!(compare(*(it - 1), *it) ||
+              (!compare(*it, *(it - 1)) && it->index > (it - 1)->index))) {
+
+            //for (Iterator it2 = start; it2 < end; ++it2)
+            //    cout << it2->value << " (" << it2->index << ") ";
+
+            cout << endl << "failed with message: " << msg << endl;
+            assert(false);
+        }
+    }
+}
+
+// sort plain arithmetic keys with std::less, which uses the SIMD sorting networks when the CPU supports them,
+// and make sure the results are identical to std::stable_sort (including the order of -0.0 and +0.0)
+// (and when there's enough cache, the radix sort does all of the work)
+template <typename T>
+void VerifyArithmetic(size_t total) {
+    vector<T> array1(total), array2, array3;
+    for (size_t index = 0; index < total; index++) {
+        array1[index] = (T)(rand() % 200) - (T)(rand() % 100);
+        if (std::is_floating_point<T>::value && array1[index] == 0 && rand() % 2) array1[index] = -array1[index];
+    }
+    array2 = array3 = array1;
+
+    Wiki::Cache<T> cache (total * 2);
+    Wiki::Sort(array1.begin(), array1.end(), std::less<T>());
+    stable_sort(array2.begin(), array2.end(), std::less<T>());
+    Wiki::Sort(array3.begin(), array3.end(), std::less<T>(), cache.cache, cache.cache + cache.cache_size);
+    assert(total == 0 || memcmp(&array1[0], &array2[0], total * sizeof(T)) == 0);
+    assert(total == 0 || memcmp(&array3[0], &array2[0], total * sizeof(T)) == 0);
+}
+
+// items that can only be moved (and not copied) should sort too
+struct TestPointerCompare {
+    bool operator()(const unique_ptr<Test> & item1, const unique_ptr<Test> & item2) const {
+        return item1->value < item2->value;
+    }
+};
+
+void VerifyMoveOnly(size_t total) {
+    vector<unique_ptr<Test> > array1(total), array2(total);
+    for (size_t index = 0; index < total; index++) {
+        Test item = Test();
+        item.value = rand() % 100;
+        item.index = index;
+
+        array1[index].reset(new Test(item));
+        array2[index].reset(new Test(item));
+    }
+
+    TestPointerCompare compare;
+    Wiki::Sort(array1.begin(), array1.end(), compare);
+    Wiki::Sort(Wiki::ParallelPolicy(4), array2.begin(), array2.end(), compare);
+
+    for (size_t index = 1; index < total; index++) {
+        assert(array1[index] && array2[index]);
+        assert(!compare(array1[index], array1[index - 1]) && !compare(array2[index], array2[index - 1]));
+        assert(compare(array1[index - 1], array1[index]) || array1[index - 1]->index < array1[index]->index);
+        assert(compare(array2[index - 1], array2[index]) || array2[index - 1]->index < array2[index]->index);
+    }
+}
+
+// items that own memory (long enough strings won't fit into the small-string buffer)
+bool StringEven(const string & item) {
+    return item.size() % 2 == 0;
+}
+
+void VerifyStrings(size_t total) {
+    vector<string> array1(total), array2, array3;
+    for (size_t index = 0; index < total; index++)
+        array1[index] = string(rand() % 40, 'a' + rand() % 4);
+    array2 = array3 = array1;
+
+    Wiki::Sort(array1.begin(), array1.end(), less<string>());
+    stable_sort(array2.begin(), array2.end(), less<string>());
+    Wiki::Sort(Wiki::ParallelPolicy(4), array3.begin(), array3.end(), less<string>());
+    assert(array1 == array2 && array3 == array2);
+
+    // partitioning moves the strings rather than copying them, so none of them should come back empty
+    for (size_t index = 0; index < total; index++)
+        array1[index] = array3[index] = string(1 + rand() % 40, 'a' + rand() % 4);
+    vector<string>::iterator partition1 = Wiki::StablePartition(array1.begin(), array1.end(), StringEven);
+    vector<string>::iterator partition3 = stable_partition(array3.begin(), array3.end(), StringEven);
+    assert(partition1 - array1.begin() == partition3 - array3.begin());
+    assert(array1 == array3);
+}
 #endif
 
-    // bottom-up merge sort combined with an in-place merge algorithm for O(1) memory use
-    template <typename RandomAccessIterator, typename Comparison>
-    void Sort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
-        // map first and last to a C-style array, so we don't have to change the rest of the code
-        // (bit of a nasty hack, but it's good enough for now...)
-        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
-        const std::size_t size = std::distance(first, last);
+namespace Testing {
+    size_t Random(size_t index, size_t total) {
+        return rand();
+    }
 
-        // if the array is of size 0, 1, 2, or 3, just sort them like so:
-        if (size < 4) {
-            if (size == 3) {
-                // hard-coded insertion sort
-                if (compare(first[1], first[0])) {
-                    std::iter_swap(first + 0, first + 1);
-                }
-                if (compare(first[2], first[1])) {
-                    std::iter_swap(first + 1, first + 2);
-                    if (compare(first[1], first[0])) {
-                        std::iter_swap(first + 0, first + 1);
-                    }
-                }
-            } else if (size == 2) {
-                // swap the items if they're out of order
-                if (compare(first[1], first[0])) {
-                    std::iter_swap(first + 0, first + 1);
-                }
-            }
+    size_t RandomFew(size_t index, size_t total) {
+        return rand() * (100.0/RAND_MAX);
+    }
+
+    size_t MostlyDescending(size_t index, size_t total) {
+        return total - index + rand() * 1.0/RAND_MAX * 5 - 2.5;
+    }
+
+    size_t MostlyAscending(size_t index, size_t total) {
+        return index + rand() * 1.0/RAND_MAX * 5 - 2.5;
+    }
+
+    size_t Ascending(size_t index, size_t total) {
+        return index;
+    }
+
+    size_t Descending(size_t index, size_t total) {
+        return total - index;
+    }
+
+    size_t Equal(size_t index, size_t total) {
+        return 1000;
+    }
+
+    size_t Jittered(size_t index, size_t total) {
+        return (rand() * 1.0/RAND_MAX <= 0.9) ? index : (index - 2);
+    }
+
+    size_t MostlyEqual(size_t index, size_t total) {
+        return 1000 + rand() * 1.0/RAND_MAX * 4;
+    }
+
+    // the last 1/5 of the data is random
+    size_t Append(size_t index, size_t total) {
+        if (index > total - total/5) return rand() * 1.0/RAND_MAX * total;
+        return index;
+    }
+}
+
+#ifndef WIKISORT_NO_MAIN
+// the benchmark sorts the same input with each algorithm, for every combination of item type, comparison,
+// distribution, and size, with a few untimed warmup runs and then repeated trials timed with a monotonic clock
+namespace Benchmark {
+    // how each type of item is made from a value in the distribution, compared, and keyed
+    template <typename T>
+    class Item {
+    public:
+        typedef std::less<T> Less;
+
+        static T make(size_t value, size_t /*index*/) { return (T)value; }
+        static bool compare(const T & item1, const T & item2) { return item1 < item2; }
+        static T key(const T & item) { return item; }
+    };
+
+    template <>
+    class Item<Test> {
+    public:
+        typedef TestLess Less;
+
+        static Test make(size_t value, size_t index) {
+            (void)index; // only used for VERIFY and TEST_STRINGS
+            Test item = Test();
+            item.value = value;
+            #if VERIFY
+                item.index = index;
+            #endif
+            #if TEST_STRINGS
+                item.payload = std::string(32 + index % 32, 'a');
+            #endif
+            return item;
+        }
+
+        static bool compare(const Test & item1, const Test & item2) { return TestCompare(item1, item2); }
+        static size_t key(const Test & item) { return TestKey(item); }
+    };
+
+    // strings that are too long for the small-string buffer, and sort in the same order as their values
+    template <>
+    class Item<string> {
+    public:
+        typedef std::less<string> Less;
+
+        static string make(size_t value, size_t /*index*/) {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%024llu", (unsigned long long)value);
+            return buffer;
+        }
+
+        static bool compare(const string & item1, const string & item2) { return item1 < item2; }
+        static const string & key(const string & item) { return item; }
+    };
+
+    // the same comparison with some fake overhead, like SLOW_COMPARISONS but without recompiling
+    template <typename T>
+    bool SlowCompare(const T & item1, const T & item2) {
+        for (std::size_t index = 0; index < NOOP_SIZE; index++)
+            noop1[index] = noop2[index];
+        return Item<T>::compare(item1, item2);
+    }
 
+    // a standard top-down merge sort with a half-size buffer, like MergeSort() in WikiSort.c, as a baseline
+    template <typename T, typename Comparison>
+    void MergeSortRange(T *first, T *last, Comparison compare, T *buffer) {
+        if (last - first < 32) {
+            InsertionSort(first, last, compare);
             return;
         }
 
-        // sort groups of 4-8 items at a time using an unstable sorting network,
-        // but keep track of the original item orders to force it to be stable
-        // http://pages.ripco.net/~jgamble/nw.html
-        Wiki::Iterator iterator (size, 4);
-        while (!iterator.finished()) {
-            int order[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
-            Range<RandomAccessIterator> range = iterator.nextRange(first);
+        T *middle = first + (last - first)/2;
+        MergeSortRange(first, middle, compare, buffer);
+        MergeSortRange(middle, last, compare, buffer);
+
+        // only the part of A that goes after the start of B has to be copied to the buffer
+        first = std::upper_bound(first, middle, *middle, compare);
+        T *A_index = buffer, *A_last = std::move(first, middle, buffer);
+        T *B_index = middle, *insert = first;
+        while (A_index < A_last && B_index < last) {
+            if (!compare(*B_index, *A_index)) *insert++ = std::move(*A_index++);
+            else *insert++ = std::move(*B_index++);
+        }
+        std::move(A_index, A_last, insert);
+    }
 
-            #define SWAP(x, y) \
-                if (compare(range.start[y], range.start[x]) || \
-                    (order[x] > order[y] && !compare(range.start[x], range.start[y]))) { \
-                    std::iter_swap(range.start + x, range.start + y); \
-                    std::iter_swap(order + x, order + y); }
-
-            if (range.length() == 8) {
-                SWAP(0, 1); SWAP(2, 3); SWAP(4, 5); SWAP(6, 7);
-                SWAP(0, 2); SWAP(1, 3); SWAP(4, 6); SWAP(5, 7);
-                SWAP(1, 2); SWAP(5, 6); SWAP(0, 4); SWAP(3, 7);
-                SWAP(1, 5); SWAP(2, 6);
-                SWAP(1, 4); SWAP(3, 6);
-                SWAP(2, 4); SWAP(3, 5);
-                SWAP(3, 4);
-
-            } else if (range.length() == 7) {
-                SWAP(1, 2); SWAP(3, 4); SWAP(5, 6);
-                SWAP(0, 2); SWAP(3, 5); SWAP(4, 6);
-                SWAP(0, 1); SWAP(4, 5); SWAP(2, 6);
-                SWAP(0, 4); SWAP(1, 5);
-                SWAP(0, 3); SWAP(2, 5);
-                SWAP(1, 3); SWAP(2, 4);
-                SWAP(2, 3);
-
-            } else if (range.length() == 6) {
-                SWAP(1, 2); SWAP(4, 5);
-                SWAP(0, 2); SWAP(3, 5);
-                SWAP(0, 1); SWAP(3, 4); SWAP(2, 5);
-                SWAP(0, 3); SWAP(1, 4);
-                SWAP(2, 4); SWAP(1, 3);
-                SWAP(2, 3);
-
-            } else if (range.length() == 5) {
-                SWAP(0, 1); SWAP(3, 4);
-                SWAP(2, 4);
-                SWAP(2, 3); SWAP(1, 4);
-                SWAP(0, 3);
-                SWAP(0, 2); SWAP(1, 3);
-                SWAP(1, 2);
-
-            } else if (range.length() == 4) {
-                SWAP(0, 1); SWAP(2, 3);
-                SWAP(0, 2); SWAP(1, 3);
-                SWAP(1, 2);
-            }
-
-            #undef SWAP
-        }
-        if (size < 8) return;
+    template <typename T, typename Comparison>
+    void MergeSort(vector<T> & items, Comparison compare) {
+        if (items.empty()) return;
+        vector<T> buffer ((items.size() + 1)/2);
+        MergeSortRange(&items[0], &items[0] + items.size(), compare, &buffer[0]);
+    }
 
-        // use a small cache to speed up some of the operations
-        #if DYNAMIC_CACHE
-            Cache<T> cache_obj (size);
-            T *cache = cache_obj.cache;
-            const std::size_t cache_size = cache_obj.cache_size;
-        #else
-            // since the cache size is fixed, it's still O(1) memory!
-            // just keep in mind that making it too small ruins the point (nothing will fit into it),
-            // and making it too large also ruins the point (so much for "low memory"!)
-            // removing the cache entirely still gives 75% of the performance of a standard merge
-            const std::size_t cache_size = 512;
-            T cache[cache_size];
-        #endif
+    const char *distribution_names[] = {
+        "Random", "RandomFew", "MostlyDescending", "MostlyAscending", "Ascending",
+        "Descending", "Equal", "Jittered", "MostlyEqual", "Append"
+    };
+    size_t (*distributions[])(size_t, size_t) = {
+        Testing::Random, Testing::RandomFew, Testing::MostlyDescending, Testing::MostlyAscending, Testing::Ascending,
+        Testing::Descending, Testing::Equal, Testing::Jittered, Testing::MostlyEqual, Testing::Append
+    };
 
-        // then merge sort the higher levels, which can be 8-15, 16-31, 32-63, 64-127, etc.
-        while (true) {
-            // if every A and B block will fit into the cache, use a special branch specifically for merging with the cache
-            // (we use < rather than <= since the block size might be one more than iterator.length())
-            if (iterator.length() < cache_size) {
-
-                // if four subarrays fit into the cache, it's faster to merge both pairs of subarrays into the cache,
-                // then merge the two merged subarrays from the cache back into the original array
-                if ((iterator.length() + 1) * 4 <= cache_size && iterator.length() * 4 <= size) {
-                    iterator.begin();
-                    while (!iterator.finished()) {
-                        // merge A1 and B1 into the cache
-                        Range<RandomAccessIterator> A1 = iterator.nextRange(first);
-                        Range<RandomAccessIterator> B1 = iterator.nextRange(first);
-                        Range<RandomAccessIterator> A2 = iterator.nextRange(first);
-                        Range<RandomAccessIterator> B2 = iterator.nextRange(first);
-
-                        if (compare(*(B1.end - 1), *A1.start)) {
-                            // the two ranges are in reverse order, so copy them in reverse order into the cache
-                            std::copy(A1.start, A1.end, cache + B1.length());
-                            std::copy(B1.start, B1.end, cache);
-                        } else if (compare(*B1.start, *(A1.end - 1))) {
-                            // these two ranges weren't already in order, so merge them into the cache
-                            std::merge(A1.start, A1.end, B1.start, B1.end, cache, compare);
-                        } else {
-                            // if A1, B1, A2, and B2 are all in order, skip doing anything else
-                            if (!compare(*B2.start, *(A2.end - 1)) &&
-                                !compare(*A2.start, *(B1.end - 1))) continue;
-
-                            // copy A1 and B1 into the cache in the same order at once
-                            std::copy(A1.start, B1.end, cache);
-                        }
-                        A1 = Range<RandomAccessIterator>(A1.start, B1.end);
-
-                        // merge A2 and B2 into the cache
-                        if (compare(*(B2.end - 1), *A2.start)) {
-                            // the two ranges are in reverse order, so copy them in reverse order into the cache
-                            std::copy(A2.start, A2.end, cache + A1.length() + B2.length());
-                            std::copy(B2.start, B2.end, cache + A1.length());
-                        } else if (compare(*B2.start, *(A2.end - 1))) {
-                            // these two ranges weren't already in order, so merge them into the cache
-                            std::merge(A2.start, A2.end, B2.start, B2.end, cache + A1.length(), compare);
-                        } else {
-                            // copy A2 and B2 into the cache in the same order at once
-                            std::copy(A2.start, B2.end, cache + A1.length());
-                        }
-                        A2 = Range<RandomAccessIterator>(A2.start, B2.end);
-
-                        // merge A1 and A2 from the cache into the array
-                        Range<T*> A3(cache, cache + A1.length());
-                        Range<T*> B3(cache + A1.length(), cache + A1.length() + A2.length());
-
-                        if (compare(*(B3.end - 1), *A3.start)) {
-                            // the two ranges are in reverse order, so copy them in reverse order into the array
-                            std::copy(A3.start, A3.end, A1.start + A2.length());
-                            std::copy(B3.start, B3.end, A1.start);
-                        } else if (compare(*B3.start, *(A3.end - 1))) {
-                            // these two ranges weren't already in order, so merge them back into the array
-                            std::merge(A3.start, A3.end, B3.start, B3.end, A1.start, compare);
-                        } else {
-                            // copy A3 and B3 into the array in the same order at once
-                            std::copy(A3.start, B3.end, A1.start);
-                        }
-                    }
+    // wiki-cache gives Wiki::Sort a cache as large as the array, wiki-parallel uses Wiki::par,
+    // and wiki-by is Wiki::SortBy, which uses each item's key and ignores the comparison
+    const char *algorithm_names[] = {
+        "wiki", "wiki-cache", "wiki-parallel", "wiki-by",
+        "stable_sort", "inplace_stable_sort", "sort", "merge_sort"
+    };
+    enum Algorithm { WikiSort, WikiSortCache, WikiSortParallel, WikiSortBy, StableSort, InplaceStableSort, StdSort, MergeSortBaseline };
 
-                    // we merged two levels at the same time, so we're done with this level already
-                    // (iterator.nextLevel() is called again at the bottom of this outer merge loop)
-                    iterator.nextLevel();
+    // sort times each of the algorithms above, merge times Wiki::InplaceMerge over a sweep of A:B ratios,
+    // append times Wiki::SortAppended keeping an array sorted as batches of items are appended to it,
+    // and partition times Wiki::StablePartition with a few different fractions of the items selected
+    const char *mode_names[] = { "sort", "merge", "append", "partition" };
+    const char *mode_baselines[] = { "stable_sort", "inplace_merge", "stable_sort", "stable_partition" };
 
-                } else {
-                    iterator.begin();
-                    while (!iterator.finished()) {
-                        Range<RandomAccessIterator> A = iterator.nextRange(first);
-                        Range<RandomAccessIterator> B = iterator.nextRange(first);
-
-                        if (compare(*(B.end - 1), *A.start)) {
-                            // the two ranges are in reverse order, so a simple rotation should fix it
-                            std::rotate(A.start, A.end, B.end);
-                        } else if (compare(*B.start, *(A.end - 1))) {
-                            // these two ranges weren't already in order, so we'll need to merge them!
-                            std::copy(A.start, A.end, cache);
-                            MergeExternal(A.start, A.end, B.start, B.end, cache, compare);
-                        }
-                    }
-                }
-            } else {
-                // this is where the in-place merge logic starts!
-                // 1. pull out two internal buffers each containing √A unique values
-                //     1a. adjust block_size and buffer_size if we couldn't find enough unique values
-                // 2. loop over the A and B subarrays within this level of the merge sort
-                //     3. break A and B into blocks of size 'block_size'
-                //     4. "tag" each of the A blocks with values from the first internal buffer
-                //     5. roll the A blocks through the B blocks and drop/rotate them where they belong
-                //     6. merge each A block with any B values that follow, using the cache or the second internal buffer
-                // 7. sort the second internal buffer if it exists
-                // 8. redistribute the two internal buffers back into the array
-
-                std::size_t block_size = std::sqrt(iterator.length());
-                std::size_t buffer_size = iterator.length()/block_size + 1;
-
-                // as an optimization, we really only need to pull out the internal buffers once for each level of merges
-                // after that we can reuse the same buffers over and over, then redistribute it when we're finished with this level
-                Range<RandomAccessIterator> buffer1(first, first);
-                Range<RandomAccessIterator> buffer2(first, first);
-                RandomAccessIterator index, last;
-                std::size_t count, pull_index = 0;
-                struct
-                {
-                    RandomAccessIterator from, to;
-                    std::size_t count;
-                    Range<RandomAccessIterator> range;
-                } pull[2];
-                pull[0].count = 0; pull[0].range = Range<RandomAccessIterator>(first, first);
-                pull[1].count = 0; pull[1].range = Range<RandomAccessIterator>(first, first);
-
-                // find two internal buffers of size 'buffer_size' each
-                // let's try finding both buffers at the same time from a single A or B subarray
-                std::size_t find = buffer_size + buffer_size;
-                bool find_separately = false;
-
-                if (block_size <= cache_size) {
-                    // if every A block fits into the cache then we won't need the second internal buffer,
-                    // so we really only need to find 'buffer_size' unique values
-                    find = buffer_size;
-                } else if (find > iterator.length()) {
-                    // we can't fit both buffers into the same A or B subarray, so find two buffers separately
-                    find = buffer_size;
-                    find_separately = true;
-                }
+    const char *type_names[] = { "test", "uint32", "uint64", "double", "string" };
+    const char *comparison_names[] = { "less", "pointer", "slow", "expensive" };
 
-                // we need to find either a single contiguous space containing 2√A unique values (which will be split up into two buffers of size √A each),
-                // or we need to find one buffer of < 2√A unique values, and a second buffer of √A unique values,
-                // OR if we couldn't find that many unique values, we need the largest possible buffer we can get
+    // the hardware events counted during each timed sort, when perf_event_open is available
+    const char *event_names[] = { "cycles", "instructions", "L1d misses", "LLC misses", "branch misses", "dTLB misses" };
+    const char *event_keys[] = { "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses" };
+    const size_t event_count = 6;
 
-                // in the case where it couldn't find a single buffer of at least √A unique values,
-                // all of the Merge steps must be replaced by a different merge algorithm (MergeInPlace)
+    // perf_event_open counters for the calling thread and any threads it starts, in user space only
+    // each event is opened on its own, so events the CPU doesn't have are just left out, and if none of them
+    // can be opened (no PMU in a VM, a container's seccomp filter, or perf_event_paranoid) the benchmark only reports timings
+    class PerfCounters {
+        int files[event_count];
+        string error;
 
-                iterator.begin();
-                while (!iterator.finished()) {
-                    Range<RandomAccessIterator> A = iterator.nextRange(first);
-                    Range<RandomAccessIterator> B = iterator.nextRange(first);
+    public:
+        PerfCounters(bool enabled) {
+            for (size_t event = 0; event < event_count; event++) files[event] = -1;
+            if (!enabled) return;
+
+        #if WIKI_PERF_EVENTS
+            // the cache events are read misses, encoded as cache | (operation << 8) | (result << 16)
+            const uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            const uint32_t types[event_count] = {
+                PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+            };
+            const uint64_t configs[event_count] = {
+                PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_L1D | read_miss,
+                PERF_COUNT_HW_CACHE_LL | read_miss, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_DTLB | read_miss
+            };
+
+            for (size_t event = 0; event < event_count; event++) {
+                perf_event_attr attributes;
+                memset(&attributes, 0, sizeof(attributes));
+                attributes.size = sizeof(attributes);
+                attributes.type = types[event];
+                attributes.config = configs[event];
+                attributes.disabled = 1;
+                attributes.inherit = 1;
+                attributes.exclude_kernel = 1;
+                attributes.exclude_hv = 1;
+                attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                files[event] = syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+                if (files[event] < 0 && error.empty()) error = strerror(errno);
+            }
+        #else
+            error = "perf_event_open is only available on Linux";
+        #endif
+        }
 
-                    // just store information about where the values will be pulled from and to,
-                    // as well as how many values there are, to create the two internal buffers
-                    #define PULL(_to) \
-                        pull[pull_index].range = Range<RandomAccessIterator>(A.start, B.end); \
-                        pull[pull_index].count = count; \
-                        pull[pull_index].from = index; \
-                        pull[pull_index].to = _to
-
-                    // check A for the number of unique values we need to fill an internal buffer
-                    // these values will be pulled out to the start of A
-                    for (last = A.start, count = 1; count < find; last = index, ++count) {
-                        index = FindLastForward(last + 1, A.end, *last, compare, find - count);
-                        if (index == A.end) break;
-                        assert(index < A.end);
-                    }
-                    index = last;
+        ~PerfCounters() {
+            for (size_t event = 0; event < event_count; event++)
+                if (files[event] >= 0) close(files[event]);
+        }
 
-                    if (count >= buffer_size) {
-                        // keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer
-                        PULL(A.start);
-                        pull_index = 1;
-
-                        if (count == buffer_size + buffer_size) {
-                            // we were able to find a single contiguous section containing 2√A unique values,
-                            // so this section can be used to contain both of the internal buffers we'll need
-                            buffer1 = Range<RandomAccessIterator>(A.start, A.start + buffer_size);
-                            buffer2 = Range<RandomAccessIterator>(A.start + buffer_size, A.start + count);
-                            break;
-                        } else if (find == buffer_size + buffer_size) {
-                            // we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values,
-                            // so we still need to find a second separate buffer of at least √A unique values
-                            buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
-                            find = buffer_size;
-                        } else if (block_size <= cache_size) {
-                            // we found the first and only internal buffer that we need, so we're done!
-                            buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
-                            break;
-                        } else if (find_separately) {
-                            // found one buffer, but now find the other one
-                            buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
-                            find_separately = false;
-                        } else {
-                            // we found a second buffer in an 'A' subarray containing √A unique values, so we're done!
-                            buffer2 = Range<RandomAccessIterator>(A.start, A.start + count);
-                            break;
-                        }
-                    } else if (pull_index == 0 && count > buffer1.length()) {
-                        // keep track of the largest buffer we were able to find
-                        buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
-                        PULL(A.start);
-                    }
+        bool available() const {
+            for (size_t event = 0; event < event_count; event++)
+                if (files[event] >= 0) return true;
+            return false;
+        }
 
-                    // check B for the number of unique values we need to fill an internal buffer
-                    // these values will be pulled out to the end of B
-                        for (last = B.end - 1, count = 1; count < find; last = index - 1, ++count) {
-                            index = FindFirstBackward(B.start, last, *last, compare, find - count);
-                            if (index == B.start) break;
-                            assert(index > B.start);
-                        }
-                        index = last;
-
-                    if (count >= buffer_size) {
-                        // keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer
-                        PULL(B.end);
-                        pull_index = 1;
-
-                        if (count == buffer_size + buffer_size) {
-                            // we were able to find a single contiguous section containing 2√A unique values,
-                            // so this section can be used to contain both of the internal buffers we'll need
-                            buffer1 = Range<RandomAccessIterator>(B.end - count, B.end - buffer_size);
-                            buffer2 = Range<RandomAccessIterator>(B.end - buffer_size, B.end);
-                            break;
-                        } else if (find == buffer_size + buffer_size) {
-                            // we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values,
-                            // so we still need to find a second separate buffer of at least √A unique values
-                            buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
-                            find = buffer_size;
-                        } else if (block_size <= cache_size) {
-                            // we found the first and only internal buffer that we need, so we're done!
-                            buffer1 = Range<RandomAccessIterator>(B.end - count, B.end );
-                            break;
-                        } else if (find_separately) {
-                            // found one buffer, but now find the other one
-                            buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
-                            find_separately = false;
-                        } else {
-                            // buffer2 will be pulled out from a 'B' subarray, so if the first buffer was pulled out from the corresponding 'A' subarray,
-                            // we need to adjust the end point for that A subarray so it knows to stop redistributing its values before reaching buffer2
-                            if (pull[0].range.start == A.start) {
-                                pull[0].range.end -= pull[1].count;
-                            }
+        // why the first event that couldn't be opened failed
+        const string & reason() const { return error; }
 
-                            // we found a second buffer in a 'B' subarray containing √A unique values, so we're done!
-                            buffer2 = Range<RandomAccessIterator>(B.end - count, B.end);
-                            break;
-                        }
-                    } else if (pull_index == 0 && count > buffer1.length()) {
-                        // keep track of the largest buffer we were able to find
-                        buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
-                        PULL(B.end);
-                    }
+        void start() {
+        #if WIKI_PERF_EVENTS
+            for (size_t event = 0; event < event_count; event++) {
+                if (files[event] < 0) continue;
+                ioctl(files[event], PERF_EVENT_IOC_RESET, 0);
+                ioctl(files[event], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        #endif
+        }
 
-                    #undef PULL
-                }
+        // add each event's count since start() to 'counts', or leave it at -1 if that event isn't being counted
+        // when there are more events than hardware counters the kernel takes turns between them,
+        // so each count is scaled up by how much of the time it was actually being counted
+        void stop(double counts[]) {
+        #if WIKI_PERF_EVENTS
+            for (size_t event = 0; event < event_count; event++) {
+                if (files[event] < 0) continue;
+                ioctl(files[event], PERF_EVENT_IOC_DISABLE, 0);
+
+                uint64_t values[3];
+                if (read(files[event], values, sizeof(values)) != sizeof(values) || values[2] == 0) continue;
+                if (counts[event] < 0) counts[event] = 0;
+                counts[event] += values[0] * ((double)values[1] / values[2]);
+            }
+        #endif
+        }
 
-                // pull out the two ranges so we can use them as internal buffers
-                for (pull_index = 0; pull_index < 2; ++pull_index) {
-                    std::size_t length = pull[pull_index].count;
-
-                    if (pull[pull_index].to < pull[pull_index].from) {
-                        // we're pulling the values out to the left, which means the start of an A subarray
-                        index = pull[pull_index].from;
-                        for (count = 1; count < length; ++count) {
-                            index = FindFirstBackward(pull[pull_index].to, pull[pull_index].from - (count - 1),
-                                                      *(index - 1), compare, length - count);
-                            Range<RandomAccessIterator> range(index + 1, pull[pull_index].from + 1);
-                            std::rotate(range.start, range.end - count, range.end);
-                            pull[pull_index].from = index + count;
-                        }
-                    } else if (pull[pull_index].to > pull[pull_index].from) {
-                        // we're pulling values out to the right, which means the end of a B subarray
-                        index = pull[pull_index].from + 1;
-                        for (count = 1; count < length; ++count) {
-                            index = FindLastForward(index, pull[pull_index].to, *index,
-                                                    compare, length - count);
-                            Range<RandomAccessIterator> range(pull[pull_index].from, index - 1);
-                            std::rotate(range.start, range.start + count, range.end);
-                            pull[pull_index].from = index - count - 1;
-                        }
-                    }
-                }
+    private:
+        PerfCounters(const PerfCounters &);
+        PerfCounters & operator=(const PerfCounters &);
+    };
 
-                // adjust block_size and buffer_size based on the values we were able to pull out
-                buffer_size = buffer1.length();
-                block_size = iterator.length() / buffer_size + 1;
+    class Options {
+    public:
+        vector<size_t> modes, distributions, algorithms, types, comparisons, sizes;
+        size_t warmup, trials;
+        unsigned int seed;
+        bool counters, perf;
+        const char *csv_path, *json_path;
 
-                // the first buffer NEEDS to be large enough to tag each of the evenly sized A blocks,
-                // so this was originally here to test the math for adjusting block_size above
-                //assert((iterator.length() + 1)/block_size <= buffer_size);
+        Options() : warmup(1), trials(5), seed(10141985), counters(false), perf(true), csv_path(0), json_path(0) {}
+    };
 
-                // now that the two internal buffers have been created, it's time to merge each A+B combination at this level of the merge sort!
-                iterator.begin();
-                while (!iterator.finished()) {
-                    Range<RandomAccessIterator> A = iterator.nextRange(first);
-                    Range<RandomAccessIterator> B = iterator.nextRange(first);
+    class Result {
+    public:
+        string mode, type, comparison, distribution, algorithm;
+        size_t size;
+        vector<double> seconds;
+        double relative;
+        bool counted;
+        Wiki::PhaseCounts counts;
+
+        // the hardware events added up over the timed trials, or -1 for events that weren't counted
+        double events[event_count];
+
+        // that event per item per trial, or -1
+        double perItem(size_t event) const {
+            if (events[event] < 0 || size == 0 || seconds.empty()) return -1;
+            return events[event] / size / seconds.size();
+        }
 
-                    // remove any parts of A or B that are being used by the internal buffers
-                    RandomAccessIterator start = A.start;
-                    if (start == pull[0].range.start) {
-                        if (pull[0].from > pull[0].to) {
-                            A.start += pull[0].count;
-
-                            // if the internal buffer takes up the entire A or B subarray, then there's nothing to merge
-                            // this only happens for very small subarrays, like √4 = 2, 2 * (2 internal buffers) = 4,
-                            // which also only happens when cache_size is small or 0 since it'd otherwise use MergeExternal
-                            if (A.length() == 0) continue;
-                        } else if (pull[0].from < pull[0].to) {
-                            B.end -= pull[0].count;
-                            if (B.length() == 0) continue;
-                        }
-                    }
-                    if (start == pull[1].range.start) {
-                        if (pull[1].from > pull[1].to) {
-                            A.start += pull[1].count;
-                            if (A.length() == 0) continue;
-                        } else if (pull[1].from < pull[1].to) {
-                            B.end -= pull[1].count;
-                            if (B.length() == 0) continue;
-                        }
-                    }
+        // the time below which 'fraction' of the (sorted) trials fell, interpolating between the nearest two
+        double percentile(double fraction) const {
+            if (seconds.empty()) return 0;
+            double position = fraction * (seconds.size() - 1);
+            size_t below = (size_t)position;
+            if (below + 1 >= seconds.size()) return seconds.back();
+            return seconds[below] + (seconds[below + 1] - seconds[below]) * (position - below);
+        }
+    };
 
-                    if (compare(*(B.end - 1), *A.start)) {
-                        // the two ranges are in reverse order, so a simple rotation should fix it
-                        std::rotate(A.start, A.end, B.end);
-                    } else if (compare(*A.end, *(A.end - 1))) {
-                        // these two ranges weren't already in order, so we'll need to merge them!
+    // a row for one algorithm on one input, before any of its trials have been run
+    Result MakeResult(size_t mode, size_t type, size_t comparison, const string & distribution, const char *algorithm, size_t size) {
+        Result result;
+        result.mode = mode_names[mode];
+        result.type = type_names[type];
+        result.comparison = comparison_names[comparison];
+        result.distribution = distribution;
+        result.algorithm = algorithm;
+        result.size = size;
+        result.relative = 0;
+        result.counted = false;
+        for (size_t event = 0; event < event_count; event++) result.events[event] = -1;
+        return result;
+    }
 
-                        // break the remainder of A into blocks. firstA is the uneven-sized first A block
-                        Range<RandomAccessIterator> blockA(A);
-                        Range<RandomAccessIterator> firstA(A.start, A.start + blockA.length() % block_size);
+    // run the warmup and timed trials for one row, where reset() puts back the input before each trial,
+    // only timed() is timed, and check() makes sure it worked
+    template <typename Reset, typename Timed, typename Check>
+    void Time(const Options & options, PerfCounters & perf, Reset reset, Timed timed, Check check, Result & result) {
+        for (size_t trial = 0; trial < options.warmup + options.trials; trial++) {
+            reset();
+            perf.start();
+            double time = Seconds();
+            timed();
+            time = Seconds() - time;
+            if (trial >= options.warmup) {
+                result.seconds.push_back(time);
+                perf.stop(result.events);
+            }
+            check();
+        }
+        std::sort(result.seconds.begin(), result.seconds.end());
+    }
 
-                        // swap the first value of each A block with the values in buffer1
-                        for (RandomAccessIterator indexA = buffer1.start, index = firstA.end;
-                             index < blockA.end;
-                             ++indexA, index += block_size) {
-                            std::iter_swap(indexA, index);
-                        }
+    template <typename T, typename Comparison>
+    void Run(Algorithm algorithm, vector<T> & items, Comparison compare) {
+        switch (algorithm) {
+            case WikiSort: Wiki::Sort(items.begin(), items.end(), compare); break;
+            case WikiSortCache: {
+                Wiki::Cache<T> cache (items.size());
+                Wiki::Sort(items.begin(), items.end(), compare, cache.cache, cache.cache + cache.cache_size);
+                break;
+            }
+            case WikiSortParallel: Wiki::Sort(Wiki::par, items.begin(), items.end(), compare); break;
+            case WikiSortBy: Wiki::SortBy(items.begin(), items.end(), Item<T>::key); break;
+            case StableSort: stable_sort(items.begin(), items.end(), compare); break;
+            case InplaceStableSort:
+                #ifdef __GLIBCXX__
+                    std::__inplace_stable_sort(items.begin(), items.end(), __gnu_cxx::__ops::__iter_comp_iter(compare));
+                #else
+                    throw std::runtime_error("inplace_stable_sort is only available with libstdc++");
+                #endif
+                break;
+            case StdSort: sort(items.begin(), items.end(), compare); break;
+            case MergeSortBaseline: MergeSort(items, compare); break;
+        }
+    }
 
-                        // start rolling the A blocks through the B blocks!
-                        // when we leave an A block behind we'll need to merge the previous A block with any B blocks that follow it, so track that information as well
-                        Range<RandomAccessIterator> lastA (firstA);
-                        Range<RandomAccessIterator> lastB (first, first);
-                        Range<RandomAccessIterator> blockB (B.start, B.start + std::min(block_size, B.length()));
-                        blockA.start += firstA.length();
-                        RandomAccessIterator indexA = buffer1.start;
-
-                        // if the first unevenly sized A block fits into the cache, copy it there for when we go to Merge it
-                        // otherwise, if the second buffer is available, block swap the contents into that
-                        if (lastA.length() <= cache_size) {
-                            std::copy(lastA.start, lastA.end, cache);
-                        } else if (buffer2.length() > 0) {
-                            std::swap_ranges(lastA.start, lastA.end, buffer2.start);
-                        }
+    // sort the items again with the operations counted, for --counters
+    // Wiki::Sort counts every operation in each of its phases, while the other algorithms only have their comparisons counted
+    // (the parallel sort isn't counted, since its threads would all be adding to the same counts,
+    // and neither is SortBy, which doesn't use the comparison)
+    template <typename T, typename Comparison>
+    bool Count(Algorithm algorithm, vector<T> & items, Comparison compare, Wiki::PhaseCounts & counts) {
+        Wiki::CountOperations counters (counts);
+        switch (algorithm) {
+            case WikiSort: Wiki::Sort(items.begin(), items.end(), compare, counters); break;
+            case WikiSortCache: {
+                Wiki::Cache<T> cache (items.size());
+                Wiki::Sort(items.begin(), items.end(), compare, cache.cache, cache.cache + cache.cache_size, counters);
+                break;
+            }
+            case WikiSortParallel: case WikiSortBy: return false;
+            default: Run(algorithm, items, Wiki::CountedComparison(compare, counters)); break;
+        }
+        return true;
+    }
 
-                        if (blockA.length() > 0) {
-                            while (true) {
-                                // if there's a previous B block and the first value of the minimum A block is <= the last value of the previous B block,
-                                // then drop that minimum A block behind. or if there are no B blocks left then keep dropping the remaining A blocks.
-                                if ((lastB.length() > 0 && !compare(*(lastB.end - 1), *indexA)) ||
-                                    blockB.length() == 0) {
-                                    // figure out where to split the previous B block, and rotate it at the split
-                                    RandomAccessIterator B_split = std::lower_bound(lastB.start, lastB.end, *indexA, compare);
-                                    std::size_t B_remaining = std::distance(B_split, lastB.end);
-
-                                    // swap the minimum A block to the beginning of the rolling A blocks
-                                    RandomAccessIterator minA = blockA.start;
-                                    for (RandomAccessIterator findA = minA + block_size ; findA < blockA.end ; findA += block_size) {
-                                        if (compare(*findA, *minA)) {
-                                            minA = findA;
-                                        }
-                                    }
-                                    std::swap_ranges(blockA.start, blockA.start + block_size, minA);
-
-                                    // swap the first item of the previous A block back with its original value, which is stored in buffer1
-                                    std::iter_swap(blockA.start, indexA);
-                                    ++indexA;
-
-                                    // locally merge the previous A block with the B values that follow it
-                                    // if lastA fits into the external cache we'll use that (with MergeExternal),
-                                    // or if the second internal buffer exists we'll use that (with MergeInternal),
-                                    // or failing that we'll use a strictly in-place merge algorithm (MergeInPlace)
-                                    if (lastA.length() <= cache_size) {
-                                        MergeExternal(lastA.start, lastA.end, lastA.end, B_split, cache, compare);
-                                    } else if (buffer2.length() > 0) {
-                                        MergeInternal(lastA.start, lastA.end, lastA.end, B_split, buffer2.start, compare);
-                                    } else {
-                                        MergeInPlace(lastA.start, lastA.end, lastA.end, B_split, compare);
-                                    }
+#if VERIFY
+    // every algorithm has to put equal items together in the same order of values as std::stable_sort,
+    // and the stable ones have to keep equal Test items in their original order too
+    template <typename T, typename Comparison>
+    bool Matches(const T & item, const T & expected, Comparison compare, bool stable) {
+        return !compare(item, expected) && !compare(expected, item);
+    }
 
-                                    if (buffer2.length() > 0 || block_size <= cache_size) {
-                                        // copy the previous A block into the cache or buffer2, since that's where we need it to be when we go to merge it anyway
-                                        if (block_size <= cache_size) {
-                                            std::copy(blockA.start, blockA.start + block_size, cache);
-                                        } else {
-                                            std::swap_ranges(blockA.start, blockA.start + block_size, buffer2.start);
-                                        }
+    template <typename Comparison>
+    bool Matches(const Test & item, const Test & expected, Comparison compare, bool stable) {
+        if (stable) return item.index == expected.index;
+        return !compare(item, expected) && !compare(expected, item);
+    }
+#endif
 
-                                        // this is equivalent to rotating, but faster
-                                        // the area normally taken up by the A block is either the contents of buffer2, or data we don't need anymore since we memcopied it
-                                        // either way we don't need to retain the order of those items, so instead of rotating we can just block swap B to where it belongs
-                                        std::swap_ranges(B_split, B_split + B_remaining, blockA.start + block_size - B_remaining);
-                                    } else {
-                                        // we are unable to use the 'buffer2' trick to speed up the rotation operation since buffer2 doesn't exist, so perform a normal rotation
-                                        std::rotate(B_split, blockA.start, blockA.start + block_size);
-                                    }
+    // the fewest comparisons per item that any comparison sort can average over every order of 'size' items, log2(n!)/n
+    double ComparisonBound(size_t size) {
+        if (size < 2) return 0;
+        return std::lgamma(size + 1.0) / std::log(2.0) / size;
+    }
+
+    // the operations per item, for each of Wiki::Sort's phases that did anything and then in total,
+    // or just the comparisons for the other algorithms
+    void PrintCounts(const Wiki::PhaseCounts & counts, size_t total, bool phases) {
+        const double items = std::max(total, (size_t)1);
+        if (!phases) {
+            cout << setw(46) << "comparisons per item: " << setprecision(2) << counts.total(Wiki::Comparisons) / items
+                 << " (log2(n!) per item: " << ComparisonBound(total) << ")" << endl;
+            return;
+        }
 
-                                    // update the range for the remaining A blocks, and the range remaining from the B block after it was split
-                                    lastA = Range<RandomAccessIterator>(blockA.start - B_remaining, blockA.start - B_remaining + block_size);
-                                    lastB = Range<RandomAccessIterator>(lastA.end, lastA.end + B_remaining);
+        cout << setw(46) << "per item:";
+        for (size_t operation = 0; operation < Wiki::OperationCount; operation++)
+            cout << setw(13) << Wiki::PhaseCounts::name((Wiki::Operation)operation);
+        cout << endl;
+
+        for (size_t phase = 0; phase <= Wiki::PhaseCount; phase++) {
+            uint64_t sum = 0;
+            for (size_t operation = 0; operation < Wiki::OperationCount; operation++)
+                sum += (phase < Wiki::PhaseCount) ? counts.counts[phase][operation] : counts.total((Wiki::Operation)operation);
+            if (sum == 0 && phase < Wiki::PhaseCount) continue;
+
+            cout << setw(46) << (phase < Wiki::PhaseCount ? Wiki::PhaseCounts::name((Wiki::Phase)phase) : "total");
+            for (size_t operation = 0; operation < Wiki::OperationCount; operation++) {
+                uint64_t count = (phase < Wiki::PhaseCount) ? counts.counts[phase][operation] : counts.total((Wiki::Operation)operation);
+                cout << setw(13) << setprecision(3) << count / items;
+            }
+            cout << endl;
+        }
+        cout << setw(46) << "log2(n!)" << setw(13) << ComparisonBound(total) << endl;
+    }
 
-                                    // if there are no more A blocks remaining, this step is finished!
-                                    blockA.start += block_size;
-                                    if (blockA.length() == 0) break;
+    void PrintHeader(size_t mode, const PerfCounters & perf) {
+        cout << "type   compare distribution            size  algorithm             median ms     p10 ms     p90 ms    ns/item  vs "
+             << setw(11) << left << mode_baselines[mode] << right;
+        if (perf.available()) {
+            cout << " ";
+            for (size_t event = 0; event < event_count; event++) cout << setw(14) << event_names[event];
+        }
+        cout << endl;
+    }
 
-                                } else if (blockB.length() < block_size) {
-                                    // move the last B block, which is unevenly sized, to before the remaining A blocks, by using a rotation
-                                    std::rotate(blockA.start, blockB.start, blockB.end);
+    // work out how many times faster than the mode's baseline each of the rows since first_result was, by their medians,
+    // then print those rows
+    void PrintResults(size_t mode, vector<Result> & results, size_t first_result, const PerfCounters & perf) {
+        for (size_t result = first_result; result < results.size(); result++) {
+            if (results[result].algorithm != mode_baselines[mode]) continue;
+            for (size_t other = first_result; other < results.size(); other++) {
+                double median = results[other].percentile(0.5);
+                if (median > 0) results[other].relative = results[result].percentile(0.5) / median;
+            }
+        }
 
-                                    lastB = Range<RandomAccessIterator>(blockA.start, blockA.start + blockB.length());
-                                    blockA.start += blockB.length();
-                                    blockA.end += blockB.length();
-                                    blockB.end = blockB.start;
-                                } else {
-                                    // roll the leftmost A block to the end by swapping it with the next B block
-                                    std::swap_ranges(blockA.start, blockA.start + block_size, blockB.start);
-                                    lastB = Range<RandomAccessIterator>(blockA.start, blockA.start + block_size);
+        for (size_t result = first_result; result < results.size(); result++) {
+            const Result & row = results[result];
+            cout << setw(7) << left << row.type << setw(8) << row.comparison << setw(17) << row.distribution
+                 << setw(11) << right << row.size << "  " << setw(20) << left << row.algorithm << right << fixed
+                 << setprecision(3) << setw(11) << row.percentile(0.5) * 1000.0
+                 << setw(11) << row.percentile(0.1) * 1000.0 << setw(11) << row.percentile(0.9) * 1000.0
+                 << setprecision(2) << setw(11) << (row.size > 0 ? row.percentile(0.5) * 1e9 / row.size : 0.0);
+            if (row.relative > 0) cout << setw(9) << row.relative << "x";
+            else if (perf.available()) cout << setw(10) << "";
+            if (perf.available()) {
+                cout << setprecision(1);
+                for (size_t event = 0; event < event_count; event++) {
+                    if (row.perItem(event) < 0) cout << setw(14) << "-";
+                    else cout << setw(14) << row.perItem(event);
+                }
+            }
+            cout << endl;
+            if (row.counted) PrintCounts(row.counts, row.size, row.algorithm == "wiki" || row.algorithm == "wiki-cache");
+        }
+    }
 
-                                    blockA.start += block_size;
-                                    blockA.end += block_size;
-                                    blockB.start += block_size;
+    template <typename T, typename Comparison>
+    void RunComparison(const Options & options, size_t type, size_t comparison, Comparison compare,
+                       PerfCounters & perf, vector<Result> & results) {
+        for (size_t distribution = 0; distribution < options.distributions.size(); distribution++) {
+            for (size_t size = 0; size < options.sizes.size(); size++) {
+                const size_t total = options.sizes[size];
+                const size_t first_result = results.size();
+
+                // the same seed for every input, so each one is the same no matter which other tests run
+                srand(options.seed);
+                vector<T> input (total), items;
+                for (size_t index = 0; index < total; index++)
+                    input[index] = Item<T>::make(distributions[options.distributions[distribution]](index, total), index);
+
+                #if VERIFY
+                    vector<T> expected (input);
+                    stable_sort(expected.begin(), expected.end(), compare);
+                #endif
+
+                for (size_t algorithm = 0; algorithm < options.algorithms.size(); algorithm++) {
+                    Result result = MakeResult(0, type, comparison, distribution_names[options.distributions[distribution]],
+                                               algorithm_names[options.algorithms[algorithm]], total);
+
+                    for (size_t trial = 0; trial < options.warmup + options.trials; trial++) {
+                        items = input;
+                        perf.start();
+                        double time = Seconds();
+                        Run((Algorithm)options.algorithms[algorithm], items, compare);
+                        time = Seconds() - time;
+                        if (trial >= options.warmup) {
+                            result.seconds.push_back(time);
+                            perf.stop(result.events);
+                        }
 
-                                    if (blockB.end > B.end - block_size) {
-                                        blockB.end = B.end;
-                                    } else {
-                                        blockB.end += block_size;
-                                    }
+                        #if VERIFY
+                            const bool stable = (options.algorithms[algorithm] != StdSort);
+                            for (size_t index = 0; index < total; index++) {
+                                if (!Matches(items[index], expected[index], compare, stable)) {
+                                    cout << endl << result.algorithm << " failed on " << result.distribution << " " << total << endl;
+                                    assert(false);
                                 }
                             }
-                        }
-
-                        // merge the last A block with the remaining B values
-                        if (lastA.length() <= cache_size) {
-                            MergeExternal(lastA.start, lastA.end, lastA.end, B.end, cache, compare);
-                        } else if (buffer2.length() > 0) {
-                            MergeInternal(lastA.start, lastA.end, lastA.end, B.end, buffer2.start, compare);
-                        } else {
-                            MergeInPlace(lastA.start, lastA.end, lastA.end, B.end, compare);
-                        }
+                        #endif
                     }
-                }
 
-                // when we're finished with this merge step we should have the one or two internal buffers left over, where the second buffer is all jumbled up
-                // insertion sort the second buffer, then redistribute the buffers back into the array using the opposite process used for creating the buffer
-
-                // while an unstable sort like std::sort could be applied here, in benchmarks it was consistently slightly slower than a simple insertion sort,
-                // even for tens of millions of items. this may be because insertion sort is quite fast when the data is already somewhat sorted, like it is here
-                InsertionSort(buffer2.start, buffer2.end, compare);
-
-                for (pull_index = 0 ; pull_index < 2 ; ++pull_index) {
-                    std::size_t unique = pull[pull_index].count * 2;
-                    if (pull[pull_index].from > pull[pull_index].to) {
-                        // the values were pulled out to the left, so redistribute them back to the right
-                        Range<RandomAccessIterator> buffer(
-                            pull[pull_index].range.start,
-                            pull[pull_index].range.start + pull[pull_index].count
-                        );
-                        while (buffer.length() > 0) {
-                            index = FindFirstForward(buffer.end, pull[pull_index].range.end,
-                                                     *buffer.start, compare, unique);
-                            std::size_t amount = index - buffer.end;
-                            std::rotate(buffer.start, buffer.end, index);
-                            buffer.start += (amount + 1);
-                            buffer.end += amount;
-                            unique -= 2;
-                        }
-                    } else if (pull[pull_index].from < pull[pull_index].to) {
-                        // the values were pulled out to the right, so redistribute them back to the left
-                        Range<RandomAccessIterator> buffer(
-                            pull[pull_index].range.end - pull[pull_index].count,
-                            pull[pull_index].range.end
-                        );
-                        while (buffer.length() > 0) {
-                            index = FindLastBackward(pull[pull_index].range.start, buffer.start,
-                                                     *(buffer.end - 1), compare, unique);
-                            std::size_t amount = buffer.start - index;
-                            std::rotate(index, index + amount, buffer.end);
-                            buffer.start -= amount;
-                            buffer.end -= (amount + 1);
-                            unique -= 2;
-                        }
+                    if (options.counters) {
+                        items = input;
+                        result.counted = Count((Algorithm)options.algorithms[algorithm], items, compare, result.counts);
                     }
+
+                    std::sort(result.seconds.begin(), result.seconds.end());
+                    results.push_back(result);
                 }
-            }
 
-            // double the size of each A and B subarray that will be merged in the next level
-            if (!iterator.nextLevel()) break;
+                PrintResults(0, results, first_result, perf);
+            }
         }
     }
-}
-
-
-
-
-// class to test stable sorting (index will contain its original index in the array, to make sure it doesn't switch places with other items)
-class Test {
-public:
-    std::size_t value;
-#if VERIFY
-    std::size_t index;
-#endif
 
-#if PROFILE
-    Test& operator=(const Test & rhs) {
-        assignments++;
-        value = rhs.value;
+    // the items have to match the expected ones, which were put in order by the standard library
+    template <typename T, typename Comparison>
+    void Check(const vector<T> & items, const vector<T> & expected, Comparison compare, const Result & result) {
         #if VERIFY
-            index = rhs.index;
+            for (size_t index = 0; index < expected.size(); index++) {
+                if (!Matches(items[index], expected[index], compare, true)) {
+                    cout << endl << result.algorithm << " failed on " << result.distribution << " " << result.size << endl;
+                    assert(false);
+                }
+            }
+        #else
+            (void)items; (void)expected; (void)compare; (void)result;
         #endif
-        return *this;
     }
-#endif
-};
-
-#if SLOW_COMPARISONS
-    #define NOOP_SIZE 50
-    std::size_t noop1[NOOP_SIZE], noop2[NOOP_SIZE];
-#endif
-
-bool TestCompare(Test item1, Test item2) {
-    #if PROFILE
-        comparisons++;
-    #endif
-
-    #if SLOW_COMPARISONS
-        // test slow comparisons by adding some fake overhead
-        // (in real-world use this might be string comparisons, etc.)
-        for (std::size_t index = 0; index < NOOP_SIZE; index++)
-            noop1[index] = noop2[index];
-    #endif
-
-    return item1.value < item2.value;
-}
-
 
-using namespace std;
+    // A:B ratios for the merge mode, from a tiny A merged into a huge B to the other way around
+    const size_t merge_ratios[][2] = {
+        { 1, 1 }, { 1, 10 }, { 1, 100 }, { 1, 1000 }, { 1, 10000 }, { 10, 1 }, { 100, 1 }, { 1000, 1 }, { 10000, 1 }
+    };
+    const char *merge_algorithm_names[] = { "wiki", "wiki-parallel", "inplace_merge" };
+
+    // merge two sorted halves of each size, split by each of the ratios above, with Wiki::InplaceMerge and std::inplace_merge
+    // (which allocates a buffer as large as the smaller half when it can)
+    template <typename T, typename Comparison>
+    void RunMerges(const Options & options, size_t type, size_t comparison, Comparison compare,
+                   PerfCounters & perf, vector<Result> & results) {
+        for (size_t distribution = 0; distribution < options.distributions.size(); distribution++) {
+            for (size_t size = 0; size < options.sizes.size(); size++) {
+                const size_t total = options.sizes[size];
+                if (total < 2) continue;
+
+                for (size_t ratio = 0; ratio < sizeof(merge_ratios)/sizeof(merge_ratios[0]); ratio++) {
+                    const size_t A_part = merge_ratios[ratio][0], B_part = merge_ratios[ratio][1];
+                    const size_t A_size = std::min(std::max(total * A_part / (A_part + B_part), (size_t)1), total - 1);
+                    const size_t first_result = results.size();
+
+                    srand(options.seed);
+                    vector<T> input (total), items, expected;
+                    for (size_t index = 0; index < total; index++)
+                        input[index] = Item<T>::make(distributions[options.distributions[distribution]](index, total), index);
+                    stable_sort(input.begin(), input.begin() + A_size, compare);
+                    stable_sort(input.begin() + A_size, input.end(), compare);
+                    #if VERIFY
+                        expected = input;
+                        std::inplace_merge(expected.begin(), expected.begin() + A_size, expected.end(), compare);
+                    #endif
+
+                    std::stringstream name;
+                    name << distribution_names[options.distributions[distribution]] << " " << A_part << ":" << B_part;
+
+                    for (size_t algorithm = 0; algorithm < sizeof(merge_algorithm_names)/sizeof(merge_algorithm_names[0]); algorithm++) {
+                        Result result = MakeResult(1, type, comparison, name.str(), merge_algorithm_names[algorithm], total);
+                        Time(options, perf, [&]() { items = input; }, [&]() {
+                            switch (algorithm) {
+                                case 0: Wiki::InplaceMerge(items.begin(), items.begin() + A_size, items.end(), compare); break;
+                                case 1: Wiki::InplaceMerge(Wiki::par, items.begin(), items.begin() + A_size, items.end(), compare); break;
+                                case 2: std::inplace_merge(items.begin(), items.begin() + A_size, items.end(), compare); break;
+                            }
+                        }, [&]() { Check(items, expected, compare, result); }, result);
+                        results.push_back(result);
+                    }
 
-// make sure the items within the given range are in a stable order
-// if you want to test the correctness of any changes you make to the main WikiSort function,
-// move this function to the top of the file and call it from within WikiSort after each step
-#if VERIFY
-template <typename Iterator, typename Comparison>
-void Verify(Iterator start, Iterator end, const Comparison compare, const string msg) {
-    for (Iterator it = start + 1; it < end ; ++it) {
-        // if it's in ascending order then we're good
-        // if both values are equal, we need to make sure the index values are ascending
-        if (!(compare(*(it - 1), *it) ||
-              (!compare(*it, *(it - 1)) && it->index > (it - 1)->index))) {
+                    PrintResults(1, results, first_result, perf);
+                }
+            }
+        }
+    }
 
-            //for (Iterator it2 = start; it2 < end; ++it2)
-            //    cout << it2->value << " (" << it2->index << ") ";
+    // how many batches the items are appended in for the append mode, so each size is tried with large and small batches
+    const size_t append_batches[] = { 10, 100, 1000 };
+    const char *append_algorithm_names[] = { "wiki", "wiki-appended", "inplace_merge", "stable_sort" };
+
+    // append the items in batches, keeping the array sorted after each one, by sorting all of it again with Wiki::Sort,
+    // with Wiki::SortAppended, by sorting the batch and then calling std::inplace_merge, or by sorting all of it with stable_sort
+    template <typename T, typename Comparison>
+    void RunAppends(const Options & options, size_t type, size_t comparison, Comparison compare,
+                    PerfCounters & perf, vector<Result> & results) {
+        for (size_t distribution = 0; distribution < options.distributions.size(); distribution++) {
+            for (size_t size = 0; size < options.sizes.size(); size++) {
+                const size_t total = options.sizes[size];
+
+                srand(options.seed);
+                vector<T> input (total), items, expected;
+                for (size_t index = 0; index < total; index++)
+                    input[index] = Item<T>::make(distributions[options.distributions[distribution]](index, total), index);
+                #if VERIFY
+                    expected = input;
+                    stable_sort(expected.begin(), expected.end(), compare);
+                #endif
+
+                for (size_t batches = 0; batches < sizeof(append_batches)/sizeof(append_batches[0]); batches++) {
+                    const size_t batch = std::max(total / append_batches[batches], (size_t)1);
+                    const size_t first_result = results.size();
+
+                    std::stringstream name;
+                    name << distribution_names[options.distributions[distribution]] << " +" << batch;
+
+                    for (size_t algorithm = 0; algorithm < sizeof(append_algorithm_names)/sizeof(append_algorithm_names[0]); algorithm++) {
+                        Result result = MakeResult(2, type, comparison, name.str(), append_algorithm_names[algorithm], total);
+                        Time(options, perf, [&]() { items.clear(); items.reserve(total); }, [&]() {
+                            for (size_t start = 0; start < total; start += batch) {
+                                const size_t sorted = items.size();
+                                items.insert(items.end(), input.begin() + start, input.begin() + std::min(start + batch, total));
+                                switch (algorithm) {
+                                    case 0: Wiki::Sort(items.begin(), items.end(), compare); break;
+                                    case 1: Wiki::SortAppended(items.begin(), items.begin() + sorted, items.end(), compare); break;
+                                    case 2:
+                                        stable_sort(items.begin() + sorted, items.end(), compare);
+                                        std::inplace_merge(items.begin(), items.begin() + sorted, items.end(), compare);
+                                        break;
+                                    case 3: stable_sort(items.begin(), items.end(), compare); break;
+                                }
+                            }
+                        }, [&]() { Check(items, expected, compare, result); }, result);
+                        results.push_back(result);
+                    }
 
-            cout << endl << "failed with message: " << msg << endl;
-            assert(false);
+                    PrintResults(2, results, first_result, perf);
+                }
+            }
         }
     }
-}
-#endif
 
-namespace Testing {
-    size_t Random(size_t index, size_t total) {
-        return rand();
-    }
+    // the percentage of the items selected for the partition mode
+    const size_t partition_selected[] = { 1, 50, 99 };
+    const char *partition_algorithm_names[] = { "wiki", "stable_partition" };
+
+    // stably partition the items with Wiki::StablePartition and std::stable_partition (which allocates a buffer
+    // for all of the items when it can), selecting the items that are less than the one at that percentile
+    template <typename T, typename Comparison>
+    void RunPartitions(const Options & options, size_t type, size_t comparison, Comparison compare,
+                       PerfCounters & perf, vector<Result> & results) {
+        for (size_t distribution = 0; distribution < options.distributions.size(); distribution++) {
+            for (size_t size = 0; size < options.sizes.size(); size++) {
+                const size_t total = options.sizes[size];
+                if (total == 0) continue;
+
+                srand(options.seed);
+                vector<T> input (total), items, expected, sorted;
+                for (size_t index = 0; index < total; index++)
+                    input[index] = Item<T>::make(distributions[options.distributions[distribution]](index, total), index);
+                sorted = input;
+                stable_sort(sorted.begin(), sorted.end(), compare);
+
+                for (size_t selected = 0; selected < sizeof(partition_selected)/sizeof(partition_selected[0]); selected++) {
+                    const T pivot = sorted[total * partition_selected[selected] / 100];
+                    auto pred = [&](const T & item) { return compare(item, pivot); };
+                    const size_t first_result = results.size();
+                    #if VERIFY
+                        expected = input;
+                        std::stable_partition(expected.begin(), expected.end(), pred);
+                    #endif
+
+                    std::stringstream name;
+                    name << distribution_names[options.distributions[distribution]] << " " << partition_selected[selected] << "%";
+
+                    for (size_t algorithm = 0; algorithm < sizeof(partition_algorithm_names)/sizeof(partition_algorithm_names[0]); algorithm++) {
+                        Result result = MakeResult(3, type, comparison, name.str(), partition_algorithm_names[algorithm], total);
+                        Time(options, perf, [&]() { items = input; }, [&]() {
+                            switch (algorithm) {
+                                case 0: Wiki::StablePartition(items.begin(), items.end(), pred); break;
+                                case 1: std::stable_partition(items.begin(), items.end(), pred); break;
+                            }
+                        }, [&]() { Check(items, expected, compare, result); }, result);
+                        results.push_back(result);
+                    }
 
-    size_t RandomFew(size_t index, size_t total) {
-        return rand() * (100.0/RAND_MAX);
+                    PrintResults(3, results, first_result, perf);
+                }
+            }
+        }
     }
 
-    size_t MostlyDescending(size_t index, size_t total) {
-        return total - index + rand() * 1.0/RAND_MAX * 5 - 2.5;
+    template <typename T, typename Comparison>
+    void RunMode(const Options & options, size_t mode, size_t type, size_t comparison, Comparison compare,
+                 PerfCounters & perf, vector<Result> & results) {
+        switch (mode) {
+            case 0: RunComparison<T>(options, type, comparison, compare, perf, results); break;
+            case 1: RunMerges<T>(options, type, comparison, compare, perf, results); break;
+            case 2: RunAppends<T>(options, type, comparison, compare, perf, results); break;
+            case 3: RunPartitions<T>(options, type, comparison, compare, perf, results); break;
+        }
     }
 
-    size_t MostlyAscending(size_t index, size_t total) {
-        return index + rand() * 1.0/RAND_MAX * 5 - 2.5;
+    template <typename T>
+    void RunType(const Options & options, size_t mode, size_t type, PerfCounters & perf, vector<Result> & results) {
+        for (size_t comparison = 0; comparison < options.comparisons.size(); comparison++) {
+            switch (options.comparisons[comparison]) {
+                case 0: RunMode<T>(options, mode, type, 0, typename Item<T>::Less(), perf, results); break;
+                case 1: RunMode<T>(options, mode, type, 1, &Item<T>::compare, perf, results); break;
+                case 2: RunMode<T>(options, mode, type, 2, &SlowCompare<T>, perf, results); break;
+                case 3: RunMode<T>(options, mode, type, 3, Wiki::Expensive(&SlowCompare<T>), perf, results); break;
+            }
+        }
     }
 
-    size_t Ascending(size_t index, size_t total) {
-        return index;
+    void WriteCSV(std::ostream & out, const vector<Result> & results) {
+        // the hardware events per item are left empty when they weren't counted
+        // vs_baseline is how many times faster than the mode's baseline (like stable_sort for the sort mode) each row was
+        out << "mode,type,comparison,distribution,size,algorithm,trials,min_ms,p10_ms,median_ms,p90_ms,max_ms,ns_per_item,vs_baseline";
+        for (size_t event = 0; event < event_count; event++) out << "," << event_keys[event] << "_per_item";
+        out << endl;
+        for (size_t index = 0; index < results.size(); index++) {
+            const Result & row = results[index];
+            out << row.mode << "," << row.type << "," << row.comparison << "," << row.distribution << "," << row.size << "," << row.algorithm << ","
+                << row.seconds.size() << "," << row.percentile(0) * 1000.0 << "," << row.percentile(0.1) * 1000.0 << ","
+                << row.percentile(0.5) * 1000.0 << "," << row.percentile(0.9) * 1000.0 << "," << row.percentile(1) * 1000.0 << ","
+                << (row.size > 0 ? row.percentile(0.5) * 1e9 / row.size : 0.0) << "," << row.relative;
+            for (size_t event = 0; event < event_count; event++) {
+                out << ",";
+                if (row.perItem(event) >= 0) out << row.perItem(event);
+            }
+            out << endl;
+        }
     }
 
-    size_t Descending(size_t index, size_t total) {
-        return total - index;
+    void WriteJSON(std::ostream & out, const Options & options, const vector<Result> & results) {
+        out << "{" << endl;
+        out << "  \"seed\": " << options.seed << ", \"warmup\": " << options.warmup << ", \"trials\": " << options.trials << "," << endl;
+        out << "  \"results\": [" << endl;
+        for (size_t index = 0; index < results.size(); index++) {
+            const Result & row = results[index];
+            out << "    {\"mode\": \"" << row.mode << "\", \"type\": \"" << row.type << "\", \"comparison\": \"" << row.comparison
+                << "\", \"distribution\": \"" << row.distribution << "\", \"size\": " << row.size
+                << ", \"algorithm\": \"" << row.algorithm << "\", \"median_ms\": " << row.percentile(0.5) * 1000.0
+                << ", \"p10_ms\": " << row.percentile(0.1) * 1000.0 << ", \"p90_ms\": " << row.percentile(0.9) * 1000.0
+                << ", \"vs_baseline\": " << row.relative;
+            for (size_t event = 0; event < event_count; event++) {
+                out << ", \"" << event_keys[event] << "_per_item\": ";
+                if (row.perItem(event) >= 0) out << row.perItem(event);
+                else out << "null";
+            }
+            out << ", \"trials_ms\": [";
+            for (size_t trial = 0; trial < row.seconds.size(); trial++)
+                out << (trial > 0 ? ", " : "") << row.seconds[trial] * 1000.0;
+            out << "]}" << (index + 1 < results.size() ? "," : "") << endl;
+        }
+        out << "  ]" << endl << "}" << endl;
     }
 
-    size_t Equal(size_t index, size_t total) {
-        return 1000;
+    // find each comma-separated name in the list, where "all" means every name
+    bool ParseNames(const string & list, const char *names[], size_t count, vector<size_t> & indexes) {
+        indexes.clear();
+        std::stringstream stream (list);
+        string name;
+        while (std::getline(stream, name, ',')) {
+            size_t index = 0;
+            if (name == "all") {
+                for (index = 0; index < count; index++) indexes.push_back(index);
+                continue;
+            }
+            while (index < count && name != names[index]) index++;
+            if (index == count) {
+                cerr << "unknown name " << name << endl;
+                return false;
+            }
+            indexes.push_back(index);
+        }
+        return !indexes.empty();
     }
 
-    size_t Jittered(size_t index, size_t total) {
-        return (rand() * 1.0/RAND_MAX <= 0.9) ? index : (index - 2);
+    // sizes can end in k or m, like 100k or 1m
+    bool ParseSizes(const string & list, vector<size_t> & sizes) {
+        sizes.clear();
+        std::stringstream stream (list);
+        string size;
+        while (std::getline(stream, size, ',')) {
+            char *end;
+            size_t value = strtoull(size.c_str(), &end, 10);
+            if (*end == 'k' || *end == 'K') { value *= 1000; end++; }
+            else if (*end == 'm' || *end == 'M') { value *= 1000000; end++; }
+            if (end == size.c_str() || *end != '\0') return false;
+            sizes.push_back(value);
+        }
+        return !sizes.empty();
     }
 
-    size_t MostlyEqual(size_t index, size_t total) {
-        return 1000 + rand() * 1.0/RAND_MAX * 4;
+    int Usage() {
+        cerr << "usage: WikiSort [--modes LIST] [--distributions LIST] [--sizes LIST] [--types LIST] [--comparisons LIST]" << endl;
+        cerr << "                [--algorithms LIST] [--warmup N] [--trials N] [--seed N] [--csv FILE] [--json FILE] [--counters] [--no-perf]" << endl;
+        cerr << "  modes: all, sort, merge, append, partition (default sort)" << endl;
+        cerr << "         sort times the algorithms below against stable_sort, merge times Wiki::InplaceMerge" << endl;
+        cerr << "         against std::inplace_merge, with A:B ratios from 1:1 to 1:10000 and 10000:1, and append" << endl;
+        cerr << "         times Wiki::SortAppended keeping the items sorted as they're appended in 10, 100, and 1000 batches," << endl;
+        cerr << "         and partition times Wiki::StablePartition against std::stable_partition selecting 1%, 50%, and 99%" << endl;
+        cerr << "  distributions: all, Random, RandomFew, MostlyDescending, MostlyAscending, Ascending," << endl;
+        cerr << "                 Descending, Equal, Jittered, MostlyEqual, Append (default Random)" << endl;
+        cerr << "  sizes: like 1000,100k,1m (default 10k,100k,1m)" << endl;
+        cerr << "  types: all, test, uint32, uint64, double, string (default test)" << endl;
+        cerr << "  comparisons: all, less, pointer, slow, expensive (default pointer)" << endl;
+        cerr << "  algorithms: all, wiki, wiki-cache, wiki-parallel, wiki-by, stable_sort, inplace_stable_sort," << endl;
+        cerr << "              sort, merge_sort (default wiki, stable_sort, inplace_stable_sort, sort, merge_sort)" << endl;
+        cerr << "  --counters sorts each input once more in the sort mode, counting the operations in each of Wiki::Sort's phases" << endl;
+        cerr << "             and the comparisons of the other algorithms" << endl;
+        cerr << "  --no-perf leaves out the hardware counters (cycles, instructions, cache, branch, and TLB misses per item)" << endl;
+        return 2;
     }
 
-    // the last 1/5 of the data is random
-    size_t Append(size_t index, size_t total) {
-        if (index > total - total/5) return rand() * 1.0/RAND_MAX * total;
-        return index;
+    bool ParseOptions(int argc, char *argv[], Options & options) {
+        ParseNames("sort", mode_names, 4, options.modes);
+        ParseNames("Random", distribution_names, 10, options.distributions);
+        ParseNames("wiki,stable_sort,inplace_stable_sort,sort,merge_sort", algorithm_names, 8, options.algorithms);
+        ParseNames("test", type_names, 5, options.types);
+        ParseNames("pointer", comparison_names, 4, options.comparisons);
+        ParseSizes("10k,100k,1m", options.sizes);
+
+        for (int index = 1; index < argc; index++) {
+            string arg = argv[index];
+            if (arg == "--counters" || arg == "--no-perf") {
+                if (arg == "--counters") options.counters = true;
+                else options.perf = false;
+                continue;
+            }
+
+            if (index + 1 >= argc) return false;
+            string value = argv[++index];
+
+            if (arg == "--modes") { if (!ParseNames(value, mode_names, 4, options.modes)) return false; }
+            else if (arg == "--distributions") { if (!ParseNames(value, distribution_names, 10, options.distributions)) return false; }
+            else if (arg == "--algorithms") { if (!ParseNames(value, algorithm_names, 8, options.algorithms)) return false; }
+            else if (arg == "--types") { if (!ParseNames(value, type_names, 5, options.types)) return false; }
+            else if (arg == "--comparisons") { if (!ParseNames(value, comparison_names, 4, options.comparisons)) return false; }
+            else if (arg == "--sizes") { if (!ParseSizes(value, options.sizes)) return false; }
+            else if (arg == "--warmup") options.warmup = strtoull(value.c_str(), 0, 10);
+            else if (arg == "--trials") options.trials = std::max(strtoull(value.c_str(), 0, 10), 1ULL);
+            else if (arg == "--seed") options.seed = strtoul(value.c_str(), 0, 10);
+            else if (arg == "--csv") options.csv_path = argv[index];
+            else if (arg == "--json") options.json_path = argv[index];
+            else return false;
+        }
+        return true;
     }
 }
 
-int main() {
-    const size_t max_size = 1500000;
-    __typeof__(&TestCompare) compare = &TestCompare;
-    vector<Test> array1, array2;
-
-    #if PROFILE
-        size_t compares1, compares2, total_compares1 = 0, total_compares2 = 0;
-        size_t assigns1, assigns2, total_assigns1 = 0, total_assigns2 = 0;
-    #endif
+int main(int argc, char *argv[]) {
+    Benchmark::Options options;
+    if (!Benchmark::ParseOptions(argc, argv, options)) return Benchmark::Usage();
 
     // initialize the random-number generator
     //srand(time(NULL));
     srand(10141985); // in case you want the same random numbers
 
+#if !SLOW_COMPARISONS && VERIFY
+    const size_t max_size = 1500000;
+    __typeof__(&TestCompare) compare = &TestCompare;
+    vector<Test> array1, array2, array3;
     size_t total = max_size;
 
-#if !SLOW_COMPARISONS && VERIFY
     __typeof__(&Testing::Random) test_cases[] = {
         Testing::Random,
         Testing::RandomFew,
@@ -1112,116 +4954,234 @@ int main() {
     cout << "running test cases... " << flush;
     array1.resize(total);
     array2.resize(total);
+    array3.resize(total);
     for (int test_case = 0; test_case < sizeof(test_cases)/sizeof(test_cases[0]); test_case++) {
         for (size_t index = 0; index < total; index++) {
             Test item = Test();
             item.value = test_cases[test_case](index, total);
             item.index = index;
 
-            array1[index] = array2[index] = item;
+            array1[index] = array2[index] = array3[index] = item;
         }
+        const vector<Test> original (array1);
         Wiki::Sort(array1.begin(), array1.end(), compare);
         stable_sort(array2.begin(), array2.end(), compare);
+        Wiki::Sort(Wiki::ParallelPolicy(4), array3.begin(), array3.end(), compare);
 
         Verify(array1.begin(), array1.end(), compare, "test case failed");
-        for (size_t index = 0; index < total; index++)
+        Verify(array3.begin(), array3.end(), compare, "parallel test case failed");
+        for (size_t index = 0; index < total; index++) {
             assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
-    }
-    cout << "passed!" << endl;
-#endif
-
-    double total_time = Seconds();
-    double total_time1 = 0, total_time2 = 0;
-
-    for (total = 0; total <= max_size; total += 2048 * 16) {
-        array1.resize(total);
-        array2.resize(total);
+            assert(!compare(array3[index], array2[index]) && !compare(array2[index], array3[index]));
+        }
 
+        // so should the radix sort, with the stack cache and with a cache for the entire array
+        Wiki::Cache<Test> radix_cache (total * 2);
+        array1 = array3 = original;
+        Wiki::Sort(array1.begin(), array1.end(), TestLess());
+        Wiki::Sort(array3.begin(), array3.end(), TestLess(), radix_cache.cache, radix_cache.cache + radix_cache.cache_size);
+        Verify(array1.begin(), array1.end(), compare, "radix test case failed");
+        Verify(array3.begin(), array3.end(), compare, "radix test case failed");
         for (size_t index = 0; index < total; index++) {
-            Test item = Test();
-
-            // Random, RandomFew, MostlyDescending, MostlyAscending,
-            // Ascending, Descending, Equal, Jittered, MostlyEqual, Append
-            item.value = Testing::Random(index, total);
-            #if VERIFY
-                item.index = index;
-            #endif
-
-            array1[index] = array2[index] = item;
+            assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
+            assert(!compare(array3[index], array2[index]) && !compare(array2[index], array3[index]));
         }
 
-        double time1 = Seconds();
-        #if PROFILE
-            comparisons = assignments = 0;
-        #endif
-        Wiki::Sort(array1.begin(), array1.end(), compare);
-        time1 = Seconds() - time1;
-        total_time1 += time1;
-
-        #if PROFILE
-            compares1 = comparisons;
-            total_compares1 += compares1;
-            assigns1 = assignments;
-            total_assigns1 += assigns1;
-        #endif
+        // counting the operations shouldn't change the results, and without a cache every phase gets used
+        // (any sort needs at least n - 1 comparisons, so this also checks that none of them went uncounted)
+        Wiki::PhaseCounts counts;
+        array3 = original;
+        Wiki::Sort(array3.begin(), array3.end(), compare, (Test *)0, (Test *)0, Wiki::CountOperations(counts));
+        Verify(array3.begin(), array3.end(), compare, "counted test case failed");
+        assert(counts.total(Wiki::Comparisons) + 1 >= total);
+        for (size_t index = 0; index < total; index++)
+            assert(!compare(array3[index], array2[index]) && !compare(array2[index], array3[index]));
+
+        // and treating the comparisons as expensive shouldn't take any more of them
+        Wiki::PhaseCounts expensive_counts;
+        array3 = original;
+        Wiki::Sort(array3.begin(), array3.end(), Wiki::Expensive(compare), (Test *)0, (Test *)0, Wiki::CountOperations(expensive_counts));
+        Verify(array3.begin(), array3.end(), compare, "expensive test case failed");
+        assert(expensive_counts.total(Wiki::Comparisons) <= counts.total(Wiki::Comparisons));
+        for (size_t index = 0; index < total; index++)
+            assert(array3[index].index == array2[index].index);
 
-        double time2 = Seconds();
-        #if PROFILE
-            comparisons = assignments = 0;
-        #endif
+        // sorting by each item's key should give the same results
+        array3 = original;
+        Wiki::SortBy(array3.begin(), array3.end(), TestKey);
+        Verify(array3.begin(), array3.end(), compare, "sort by key test case failed");
+        for (size_t index = 0; index < total; index++)
+            assert(!compare(array3[index], array2[index]) && !compare(array2[index], array3[index]));
 
-        #if TEST_INPLACE
-            __inplace_stable_sort(array2.begin(), array2.end(), compare);
-        #else
-            stable_sort(array2.begin(), array2.end(), compare);
-        #endif
-        time2 = Seconds() - time2;
-        total_time2 += time2;
-
-        #if PROFILE
-            compares2 = comparisons;
-            total_compares2 += compares2;
-            assigns2 = assignments;
-            total_assigns2 += assigns2;
-        #endif
+        // and so should sorting a deque, which goes through pointers to its segments, with the stack cache and without one
+        deque<Test> segmented (original.begin(), original.end());
+        Wiki::Sort(segmented.begin(), segmented.end(), compare);
+        Verify(segmented.begin(), segmented.end(), compare, "deque test case failed");
+        for (size_t index = 0; index < total; index++)
+            assert(segmented[index].index == array2[index].index);
+        segmented.assign(original.begin(), original.end());
+        Wiki::Sort(segmented.begin(), segmented.end(), compare, (Test *)0, (Test *)0);
+        for (size_t index = 0; index < total; index++)
+            assert(segmented[index].index == array2[index].index);
+
+        // merging the sorted first third of the array with the sorted rest of it should give the same results
+        const size_t third = total / 3;
+        vector<Test> thirds (original);
+        stable_sort(thirds.begin(), thirds.begin() + third, compare);
+        stable_sort(thirds.begin() + third, thirds.end(), compare);
+        array1 = array3 = thirds;
+        Wiki::InplaceMerge(array1.begin(), array1.begin() + third, array1.end(), compare);
+        Wiki::InplaceMerge(Wiki::ParallelPolicy(4), array3.begin(), array3.begin() + third, array3.end(), compare);
+        Verify(array1.begin(), array1.end(), compare, "merge test case failed");
+        Verify(array3.begin(), array3.end(), compare, "parallel merge test case failed");
+        for (size_t index = 0; index < total; index++) {
+            assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
+            assert(!compare(array3[index], array2[index]) && !compare(array2[index], array3[index]));
+        }
 
-        cout << "[" << total << "]" << endl;
+        // and so should sorting a few items appended to the end of a sorted array, then merging them in
+        const size_t appended = total / 50;
+        array1 = original;
+        stable_sort(array1.begin(), array1.end() - appended, compare);
+        Wiki::SortAppended(array1.begin(), array1.end() - appended, array1.end(), compare);
+        Verify(array1.begin(), array1.end(), compare, "sort appended test case failed");
+        for (size_t index = 0; index < total; index++)
+            assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
 
-        if (time1 >= time2) cout << "WikiSort: " << time1 << " seconds, stable_sort: " << time2 << " seconds (" << time2/time1 * 100.0 << "% as fast)" << endl;
-        else cout << "WikiSort: " << time1 << " seconds, stable_sort: " << time2 << " seconds (" << time2/time1 * 100.0 - 100.0 << "% faster)" << endl;
+        // and so should merging a few sorted runs of different sizes all at once, into another array and in place
+        vector<vector<Test>::iterator> starts;
+        vector<std::pair<vector<Test>::iterator, vector<Test>::iterator> > runs;
+        array1 = array3 = original;
+        for (size_t run = 0; run < 7; run++) {
+            size_t start = total * run * run / 49, end = total * (run + 1) * (run + 1) / 49;
+            stable_sort(array3.begin() + start, array3.begin() + end, compare);
+            if (run > 0) starts.push_back(array3.begin() + start);
+            runs.push_back(std::make_pair(array3.begin() + start, array3.begin() + end));
+        }
+        assert(Wiki::MergeK(runs.begin(), runs.end(), array1.begin(), compare) == array1.end());
+        Wiki::InplaceMergeK(array3.begin(), starts.begin(), starts.end(), array3.end(), compare);
+        for (size_t index = 0; index < total; index++) {
+            assert(array1[index].index == array2[index].index);
+            assert(array3[index].index == array2[index].index);
+        }
 
-        #if PROFILE
-            if (compares1 <= compares2) cout << "WikiSort: " << compares1 << " compares, stable_sort: " << compares2 << " compares (" << compares1 * 100.0/compares2 << "% as many)" << endl;
-            else cout << "WikiSort: " << compares1 << " compares, stable_sort: " << compares2 << " compares (" << compares1 * 100.0/compares2 - 100.0 << "% more)" << endl;
+        // the smallest tenth of the array should come out the same, from the partial sort and from TopK
+        const size_t smallest = total / 10;
+        array1 = original;
+        Wiki::PartialSort(array1.begin(), array1.begin() + smallest, array1.end(), compare);
+        Wiki::TopK<Test, bool (*)(const Test &, const Test &)> top (smallest, compare);
+        top.push(original.begin(), original.end());
+        assert(top.sorted().size() == smallest);
+        Verify(array1.begin(), array1.begin() + smallest, compare, "partial sort test case failed");
+        Verify(top.sorted().begin(), top.sorted().end(), compare, "top k test case failed");
+        for (size_t index = 0; index < smallest; index++) {
+            assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
+            assert(top.sorted()[index].index == array2[index].index);
+        }
 
-            if (assigns1 <= assigns2) cout << "WikiSort: " << assigns1 << " assigns, stable_sort: " << assigns2 << " assigns (" << assigns1 * 100.0/assigns2 << "% as many)" << endl;
-            else cout << "WikiSort: " << assigns1 << " assigns, stable_sort: " << assigns2 << " assigns (" << assigns1 * 100.0/assigns2 - 100.0 << "% more)" << endl;
-        #endif
+        // partitioning by whether the value is odd should keep both halves in their original order, like std::stable_partition
+        array1 = array3 = original;
+        vector<Test>::iterator partition1 = Wiki::StablePartition(array1.begin(), array1.end(), TestOdd);
+        vector<Test>::iterator partition3 = stable_partition(array3.begin(), array3.end(), TestOdd);
+        assert(partition1 - array1.begin() == partition3 - array3.begin());
+        for (size_t index = 0; index < total; index++)
+            assert(array1[index].index == array3[index].index);
+
+        // the scratch memory can be any size, from none at all up to half of the array
+        Wiki::Cache<Test> scratch (total);
+        const size_t scratch_sizes[] = { 0, 1, 100, total/16, (total + 1)/2 };
+        for (std::size_t scratch_size = 0; scratch_size < sizeof(scratch_sizes)/sizeof(scratch_sizes[0]); scratch_size++) {
+            Test *scratch_begin = scratch.cache;
+            Test *scratch_end = scratch_begin + std::min(scratch_sizes[scratch_size], scratch.cache_size);
+
+            array1 = array3 = original;
+            Wiki::Sort(array1.begin(), array1.end(), compare, scratch_begin, scratch_end);
+            Wiki::Sort(Wiki::ParallelPolicy(4), array3.begin(), array3.end(), compare, scratch_begin, scratch_end);
+
+            // with half of the array as scratch it's a standard merge sort, which never pulls out internal buffers
+            if (scratch_sizes[scratch_size] >= (total + 1)/2 && scratch.cache_size >= (total + 1)/2) {
+                Wiki::PhaseCounts scratch_counts;
+                array3 = original;
+                Wiki::Sort(array3.begin(), array3.end(), compare, scratch_begin, scratch_end, Wiki::CountOperations(scratch_counts));
+                for (size_t operation = 0; operation < Wiki::OperationCount; operation++) {
+                    assert(scratch_counts.counts[Wiki::PullPhase][operation] == 0);
+                    assert(scratch_counts.counts[Wiki::BlockPhase][operation] == 0);
+                }
+            }
 
-        #if VERIFY
-            // make sure the arrays are sorted correctly, and that the results were stable
-            cout << "verifying... " << flush;
+            for (size_t index = 0; index < total; index++) {
+                assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
+                assert(!compare(array3[index], array2[index]) && !compare(array2[index], array3[index]));
+            }
 
-            Verify(array1.begin(), array1.end(), compare, "testing the final array");
+            array1 = original;
+            Wiki::Sort(array1.begin(), array1.end(), Wiki::Expensive(compare), scratch_begin, scratch_end);
             for (size_t index = 0; index < total; index++)
+                assert(array1[index].index == array2[index].index);
+
+            array1 = array3 = thirds;
+            Wiki::InplaceMerge(array1.begin(), array1.begin() + third, array1.end(), compare, scratch_begin, scratch_end);
+            Wiki::InplaceMerge(Wiki::ParallelPolicy(4), array3.begin(), array3.begin() + third, array3.end(), compare,
+                               scratch_begin, scratch_end);
+            Verify(array1.begin(), array1.end(), compare, "merge test case failed");
+            Verify(array3.begin(), array3.end(), compare, "parallel merge test case failed");
+            for (size_t index = 0; index < total; index++) {
                 assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
-
-            cout << "correct!" << endl;
-        #endif
+                assert(!compare(array3[index], array2[index]) && !compare(array2[index], array3[index]));
+            }
+        }
     }
 
+    VerifyArithmetic<int32_t>(total);
+    VerifyArithmetic<uint32_t>(total);
+    VerifyArithmetic<float>(total);
+    VerifyArithmetic<int64_t>(total);
+    VerifyArithmetic<uint64_t>(total);
+    VerifyArithmetic<double>(total);
+    VerifyMoveOnly(total);
+    VerifyStrings(total);
+    cout << "passed!" << endl;
+#endif
+
+    double total_time = Seconds();
+    vector<Benchmark::Result> results;
+
+    // the hardware counters are reported per item next to the timings, when there are any
+    Benchmark::PerfCounters perf (options.perf);
+    if (options.perf && !perf.available())
+        cerr << "hardware counters unavailable (" << perf.reason() << "), only reporting timings" << endl;
+
+    try {
+        for (size_t mode = 0; mode < options.modes.size(); mode++) {
+            Benchmark::PrintHeader(options.modes[mode], perf);
+            for (size_t type = 0; type < options.types.size(); type++) {
+                switch (options.types[type]) {
+                    case 0: Benchmark::RunType<Test>(options, options.modes[mode], 0, perf, results); break;
+                    case 1: Benchmark::RunType<uint32_t>(options, options.modes[mode], 1, perf, results); break;
+                    case 2: Benchmark::RunType<uint64_t>(options, options.modes[mode], 2, perf, results); break;
+                    case 3: Benchmark::RunType<double>(options, options.modes[mode], 3, perf, results); break;
+                    case 4: Benchmark::RunType<string>(options, options.modes[mode], 4, perf, results); break;
+                }
+            }
+        }
+    } catch (const std::exception & error) {
+        cerr << "WikiSort: " << error.what() << endl;
+        return 1;
+    }
     total_time = Seconds() - total_time;
     cout << "Tests completed in " << total_time << " seconds" << endl;
-    if (total_time1 >= total_time2) cout << "WikiSort: " << total_time1 << " seconds, stable_sort: " << total_time2 << " seconds (" << total_time2/total_time1 * 100.0 << "% as fast)" << endl;
-    else cout << "WikiSort: " << total_time1 << " seconds, stable_sort: " << total_time2 << " seconds (" << total_time2/total_time1 * 100.0 - 100.0 << "% faster)" << endl;
-
-    #if PROFILE
-        if (total_compares1 <= total_compares2) cout << "WikiSort: " << total_compares1 << " compares, stable_sort: " << total_compares2 << " compares (" << total_compares1 * 100.0/total_compares2 << "% as many)" << endl;
-        else cout << "WikiSort: " << total_compares1 << " compares, stable_sort: " << total_compares2 << " compares (" << total_compares1 * 100.0/total_compares2 - 100.0 << "% more)" << endl;
 
-        if (total_assigns1 <= total_assigns2) cout << "WikiSort: " << total_assigns1 << " assigns, stable_sort: " << total_assigns2 << " assigns (" << total_assigns1 * 100.0/total_assigns2 << "% as many)" << endl;
-        else cout << "WikiSort: " << total_assigns1 << " assigns, stable_sort: " << total_assigns2 << " assigns (" << total_assigns1 * 100.0/total_assigns2 - 100.0 << "% more)" << endl;
-    #endif
+    if (options.csv_path) {
+        ofstream csv (options.csv_path);
+        Benchmark::WriteCSV(csv, results);
+        if (!csv) cerr << "couldn't write " << options.csv_path << endl;
+    }
+    if (options.json_path) {
+        ofstream json (options.json_path);
+        Benchmark::WriteJSON(json, options, results);
+        if (!json) cerr << "couldn't write " << options.json_path << endl;
+    }
 
     return 0;
 }
+#endif
@@ -0,0 +1,188 @@
+/***********************************************************
+ wikisort-file: sort a file of fixed-size binary records in place, using WikiSort
+
+ to run:
+ clang++ -o wikisort-file WikiSortFile.cpp -O3 -pthread
+ (or replace 'clang++' with 'g++')
+ ./wikisort-file --record-size 100 --key-offset 0 --key-width 10 --key-type bytes records.bin
+
+ to write a file of records to test it with, from one of the distributions in WikiSort.cpp's tests:
+ ./wikisort-file --generate Random --count 10000000 --record-size 100 --key-width 10 records.bin
+
+ the key types are bytes (compared with memcmp), uint, int, and float,
+ and numeric keys are little-endian unless --big-endian is given
+
+ files that don't fit into memory can be sorted into a separate output file instead,
+ using up to --memory megabytes and writing the sorted runs to a temporary file in --temp:
+ ./wikisort-file --record-size 100 --key-width 10 --output sorted.bin --memory 1024 --temp /tmp records.bin
+ (--sync reads the runs back without the background thread, to compare against)
+***********************************************************/
+
+#define WIKISORT_NO_MAIN
+#include "WikiSort.cpp"
+
+// write 'value' as the key of the record, the same way SortFile will read it back
+void WriteKey(unsigned char *record, const Wiki::FileSortOptions & options, size_t value) {
+    unsigned char *key = record + options.key_offset;
+    if (options.key_type == Wiki::FileSortOptions::Bytes) {
+        for (size_t index = options.key_width; index > 0; index--) {
+            key[index - 1] = '0' + value % 10;
+            value /= 10;
+        }
+        return;
+    }
+
+    uint64_t bits = value;
+    if (options.key_type == Wiki::FileSortOptions::Float) {
+        if (options.key_width == 4) {
+            float number = value;
+            uint32_t bits32;
+            memcpy(&bits32, &number, sizeof(bits32));
+            bits = bits32;
+        } else {
+            double number = value;
+            memcpy(&bits, &number, sizeof(bits));
+        }
+    }
+    for (size_t index = 0; index < options.key_width; index++) {
+        unsigned char byte = (bits >> (index * 8)) & 0xFF;
+        if (options.big_endian) key[options.key_width - 1 - index] = byte;
+        else key[index] = byte;
+    }
+}
+
+// fill the file with records whose keys come from the distribution, and whose other bytes are printable text
+// with a space after the key and a newline at the end, so the same file can be sorted as lines by sort(1)
+bool Generate(const char *path, const Wiki::FileSortOptions & options, size_t (*distribution)(size_t, size_t), size_t count) {
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+
+    const size_t batch = std::max((size_t)(1 << 20) / options.record_size, (size_t)1);
+    vector<unsigned char> records (batch * options.record_size);
+    for (size_t start = 0; start < count; start += batch) {
+        size_t end = std::min(start + batch, count);
+        for (size_t index = start; index < end; index++) {
+            unsigned char *record = &records[(index - start) * options.record_size];
+            for (size_t offset = 0; offset < options.record_size; offset++) record[offset] = 'a' + (index + offset) % 26;
+            if (options.key_offset + options.key_width < options.record_size) record[options.key_offset + options.key_width] = ' ';
+            record[options.record_size - 1] = '\n';
+            WriteKey(record, options, distribution(index, count));
+        }
+        if (fwrite(&records[0], options.record_size, end - start, file) != end - start) {
+            fclose(file);
+            return false;
+        }
+    }
+    return fclose(file) == 0;
+}
+
+int Usage() {
+    cerr << "usage: wikisort-file --record-size N [--key-offset N] [--key-width N] [--key-type bytes|uint|int|float]" << endl;
+    cerr << "                     [--big-endian | --little-endian] [--generate DISTRIBUTION --count N]" << endl;
+    cerr << "                     [--output FILE [--memory MB] [--temp DIRECTORY] [--sync]] FILE" << endl;
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    Wiki::FileSortOptions options;
+    const char *path = 0, *generate = 0, *output = 0, *temp = "/tmp";
+    size_t count = 0, memory = 1024;
+    bool asynchronous = true;
+
+    for (int index = 1; index < argc; index++) {
+        string arg = argv[index];
+        bool has_value = (index + 1 < argc);
+
+        if (arg == "--big-endian") options.big_endian = true;
+        else if (arg == "--little-endian") options.big_endian = false;
+        else if (arg == "--sync") asynchronous = false;
+        else if (arg == "--record-size" && has_value) options.record_size = strtoull(argv[++index], 0, 10);
+        else if (arg == "--key-offset" && has_value) options.key_offset = strtoull(argv[++index], 0, 10);
+        else if (arg == "--key-width" && has_value) options.key_width = strtoull(argv[++index], 0, 10);
+        else if (arg == "--count" && has_value) count = strtoull(argv[++index], 0, 10);
+        else if (arg == "--generate" && has_value) generate = argv[++index];
+        else if (arg == "--output" && has_value) output = argv[++index];
+        else if (arg == "--memory" && has_value) memory = strtoull(argv[++index], 0, 10);
+        else if (arg == "--temp" && has_value) temp = argv[++index];
+        else if (arg == "--key-type" && has_value) {
+            string type = argv[++index];
+            if (type == "bytes") options.key_type = Wiki::FileSortOptions::Bytes;
+            else if (type == "uint") options.key_type = Wiki::FileSortOptions::Unsigned;
+            else if (type == "int") options.key_type = Wiki::FileSortOptions::Signed;
+            else if (type == "float") options.key_type = Wiki::FileSortOptions::Float;
+            else return Usage();
+        }
+        else if (!path && arg.compare(0, 2, "--") != 0) path = argv[index];
+        else return Usage();
+    }
+
+    if (!path || options.record_size == 0 || memory == 0) return Usage();
+    if (options.key_offset >= options.record_size) {
+        cerr << "wikisort-file: the key offset has to be within the record" << endl;
+        return 2;
+    }
+    if (options.key_width == 0) options.key_width = options.record_size - options.key_offset;
+
+    // the generated keys are written where the sort will read them, so they have to fit too
+    try {
+        Wiki::ValidateOptions(options);
+    } catch (const std::exception & error) {
+        cerr << "wikisort-file: " << error.what() << endl;
+        return 2;
+    }
+
+    if (generate) {
+        const char *names[] = {
+            "Random", "RandomFew", "MostlyDescending", "MostlyAscending", "Ascending",
+            "Descending", "Equal", "Jittered", "MostlyEqual", "Append"
+        };
+        size_t (*distributions[])(size_t, size_t) = {
+            Testing::Random, Testing::RandomFew, Testing::MostlyDescending, Testing::MostlyAscending, Testing::Ascending,
+            Testing::Descending, Testing::Equal, Testing::Jittered, Testing::MostlyEqual, Testing::Append
+        };
+
+        for (size_t index = 0; index < sizeof(names)/sizeof(names[0]); index++) {
+            if (string(generate) != names[index]) continue;
+
+            srand(10141985);
+            if (!Generate(path, options, distributions[index], count)) {
+                cerr << "couldn't write " << path << ": " << strerror(errno) << endl;
+                return 1;
+            }
+            return 0;
+        }
+
+        cerr << "unknown distribution " << generate << endl;
+        return 2;
+    }
+
+    if (output) {
+        Wiki::ExternalSortStats stats;
+        try {
+            stats = Wiki::ExternalSortFile(path, output, options, memory << 20, temp, asynchronous);
+        } catch (const std::exception & error) {
+            cerr << "wikisort-file: " << error.what() << endl;
+            return 1;
+        }
+
+        double megabytes = stats.bytes / 1048576.0;
+        cout << "sorted " << path << " into " << output << " (" << stats.runs << " runs)" << endl;
+        if (stats.runs > 0)
+            cout << "runs:  " << stats.run_seconds << " seconds, " << megabytes / stats.run_seconds << " MB/s" << endl;
+        if (stats.runs > 1)
+            cout << "merge: " << stats.merge_seconds << " seconds, " << megabytes / stats.merge_seconds << " MB/s" << endl;
+        return 0;
+    }
+
+    double time = Seconds();
+    try {
+        Wiki::SortFile(path, options);
+    } catch (const std::exception & error) {
+        cerr << "wikisort-file: " << error.what() << endl;
+        return 1;
+    }
+    time = Seconds() - time;
+
+    cout << "sorted " << path << " in " << time << " seconds" << endl;
+    return 0;
+}